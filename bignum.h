@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Arbitrary precision kernels backing BigInt cells.
+// A magnitude is a little-endian array of 32 bit limbs, the sign is kept by the caller.
+// All kernels work on raw limb pointers, so they can read operands straight from the VM heap.
+
+typedef std::vector<uint32_t> limbs_t;
+
+// below this many limbs (of the shorter operand) schoolbook multiplication is faster than Karatsuba
+const size_t KARATSUBA_THRESHOLD = 32;
+
+inline size_t bn_normalize(const uint32_t* a, size_t n)
+{
+    while (n && !a[n - 1]) --n;
+    return n;
+}
+
+inline int bn_cmp(const uint32_t* a, size_t na, const uint32_t* b, size_t nb)
+{
+    na = bn_normalize(a, na);
+    nb = bn_normalize(b, nb);
+    if (na != nb) return na < nb ? -1 : 1;
+    for (size_t i = na; i-- > 0;)
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+// r = a + b, r must have room for max(na, nb) + 1 limbs
+inline size_t bn_add(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r)
+{
+    if (na < nb) { std::swap(a, b); std::swap(na, nb); }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < nb; ++i) { carry += uint64_t(a[i]) + b[i]; r[i] = uint32_t(carry); carry >>= 32; }
+    for (; i < na; ++i) { carry += a[i]; r[i] = uint32_t(carry); carry >>= 32; }
+    r[na] = uint32_t(carry);
+    return na + 1;
+}
+
+// r = a - b, requires a >= b, r must have room for na limbs (r may alias a)
+inline size_t bn_sub(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r)
+{
+    int64_t borrow = 0;
+    size_t i = 0;
+    for (; i < nb; ++i) { borrow += int64_t(a[i]) - b[i]; r[i] = uint32_t(borrow); borrow >>= 32; }
+    for (; i < na; ++i) { borrow += a[i]; r[i] = uint32_t(borrow); borrow >>= 32; }
+    return na;
+}
+
+// r += a, the result must fit into nr limbs
+inline void bn_add_in_place(uint32_t* r, size_t nr, const uint32_t* a, size_t na)
+{
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < na; ++i) { carry += uint64_t(r[i]) + a[i]; r[i] = uint32_t(carry); carry >>= 32; }
+    for (; carry && i < nr; ++i) { carry += r[i]; r[i] = uint32_t(carry); carry >>= 32; }
+}
+
+// r = a * b, r must have room for na + nb limbs and must not alias the operands
+inline void bn_mul_schoolbook(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r)
+{
+    std::fill(r, r + na + nb, 0);
+    for (size_t i = 0; i < na; ++i)
+    {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < nb; ++j)
+        {
+            carry += uint64_t(a[i]) * b[j] + r[i + j];
+            r[i + j] = uint32_t(carry);
+            carry >>= 32;
+        }
+        r[i + nb] = uint32_t(carry);
+    }
+}
+
+inline void bn_mul(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r);
+
+// a = a1 * B^m + a0, b = b1 * B^m + b0
+// a * b = z2 * B^2m + ((a0 + a1) * (b0 + b1) - z2 - z0) * B^m + z0, with z2 = a1 * b1, z0 = a0 * b0
+inline void bn_mul_karatsuba(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r)
+{
+    std::fill(r, r + na + nb, 0);
+    // very unbalanced operands: multiply b by na / nb sized slices of a
+    if (nb <= na / 2)
+    {
+        limbs_t t(2 * nb);
+        for (size_t i = 0; i < na; i += nb)
+        {
+            const size_t n = std::min(nb, na - i);
+            bn_mul(a + i, n, b, nb, t.data());
+            bn_add_in_place(r + i, na + nb - i, t.data(), n + nb);
+        }
+        return;
+    }
+    const size_t m = na / 2;
+    const size_t na1 = na - m, nb1 = nb - m;
+    // z0 and z2 go straight into their slots of the result
+    bn_mul(a, m, b, m, r);
+    bn_mul(a + m, na1, b + m, nb1, r + 2 * m);
+    limbs_t sa(std::max(m, na1) + 1), sb(std::max(m, nb1) + 1);
+    const size_t nsa = bn_add(a, m, a + m, na1, sa.data());
+    const size_t nsb = bn_add(b, m, b + m, nb1, sb.data());
+    limbs_t z1(nsa + nsb);
+    bn_mul(sa.data(), nsa, sb.data(), nsb, z1.data());
+    bn_sub(z1.data(), z1.size(), r, 2 * m, z1.data());
+    bn_sub(z1.data(), z1.size(), r + 2 * m, na1 + nb1, z1.data());
+    bn_add_in_place(r + m, na + nb - m, z1.data(), bn_normalize(z1.data(), z1.size()));
+}
+
+// r = a * b, r must have room for na + nb limbs and must not alias the operands
+inline void bn_mul(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, uint32_t* r)
+{
+    if (na < nb) { std::swap(a, b); std::swap(na, nb); }
+    if (nb < KARATSUBA_THRESHOLD) bn_mul_schoolbook(a, na, b, nb, r);
+    else bn_mul_karatsuba(a, na, b, nb, r);
+}
+
+// q = a / b, r = a % b (Knuth, algorithm D), b must be normalized and non zero
+inline void bn_divmod(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, limbs_t& q, limbs_t& r)
+{
+    na = bn_normalize(a, na);
+    if (bn_cmp(a, na, b, nb) < 0)
+    {
+        q.assign(1, 0);
+        r.assign(a, a + na);
+        return;
+    }
+    q.assign(na - nb + 1, 0);
+    if (nb == 1)
+    {
+        uint64_t rem = 0;
+        for (size_t i = na; i-- > 0;)
+        {
+            const uint64_t cur = (rem << 32) | a[i];
+            q[i] = uint32_t(cur / b[0]);
+            rem = cur % b[0];
+        }
+        r.assign(1, uint32_t(rem));
+        return;
+    }
+    // normalize so that the top limb of the divisor has its high bit set
+    const int s = __builtin_clz(b[nb - 1]);
+    limbs_t vn(nb), un(na + 1);
+    for (size_t i = nb - 1; i > 0; --i) vn[i] = (b[i] << s) | uint32_t(uint64_t(b[i - 1]) >> (32 - s));
+    vn[0] = b[0] << s;
+    un[na] = uint32_t(uint64_t(a[na - 1]) >> (32 - s));
+    for (size_t i = na - 1; i > 0; --i) un[i] = (a[i] << s) | uint32_t(uint64_t(a[i - 1]) >> (32 - s));
+    un[0] = a[0] << s;
+    for (size_t j = na - nb + 1; j-- > 0;)
+    {
+        // estimate the quotient digit, it is at most 2 too large
+        const uint64_t num = (uint64_t(un[j + nb]) << 32) | un[j + nb - 1];
+        uint64_t qhat = num / vn[nb - 1];
+        uint64_t rhat = num % vn[nb - 1];
+        while (qhat >= (1ull << 32) || qhat * vn[nb - 2] > ((rhat << 32) | un[j + nb - 2]))
+        {
+            qhat -= 1;
+            rhat += vn[nb - 1];
+            if (rhat >= (1ull << 32)) break;
+        }
+        // multiply and subtract
+        int64_t k = 0, t = 0;
+        for (size_t i = 0; i < nb; ++i)
+        {
+            const uint64_t p = qhat * vn[i];
+            t = int64_t(un[i + j]) - k - int64_t(p & 0xFFFFFFFFull);
+            un[i + j] = uint32_t(t);
+            k = int64_t(p >> 32) - (t >> 32);
+        }
+        t = int64_t(un[j + nb]) - k;
+        un[j + nb] = uint32_t(t);
+        q[j] = uint32_t(qhat);
+        // subtracted too much, add the divisor back
+        if (t < 0)
+        {
+            q[j] -= 1;
+            uint64_t carry = 0;
+            for (size_t i = 0; i < nb; ++i)
+            {
+                carry += uint64_t(un[i + j]) + vn[i];
+                un[i + j] = uint32_t(carry);
+                carry >>= 32;
+            }
+            un[j + nb] += uint32_t(carry);
+        }
+    }
+    // unnormalize the remainder
+    r.resize(nb);
+    for (size_t i = 0; i < nb; ++i)
+        r[i] = (un[i] >> s) | uint32_t(uint64_t(un[i + 1]) << (32 - s));
+}
+
+// a = a * m + add
+inline void bn_mul_small_add(limbs_t& a, uint32_t m, uint32_t add)
+{
+    uint64_t carry = add;
+    for (auto& limb : a)
+    {
+        carry += uint64_t(limb) * m;
+        limb = uint32_t(carry);
+        carry >>= 32;
+    }
+    if (carry) a.push_back(uint32_t(carry));
+}
+
+// parses an optionally signed decimal literal
+inline void bn_from_decimal(const std::string& text, limbs_t& a, bool& negative)
+{
+    size_t i = 0;
+    negative = false;
+    if (!text.empty() && (text[0] == '-' || text[0] == '+')) negative = text[i++] == '-';
+    a.clear();
+    for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; ++i)
+        bn_mul_small_add(a, 10, text[i] - '0');
+    a.resize(bn_normalize(a.data(), a.size()));
+    if (a.empty()) negative = false;
+}
+
+inline std::string bn_to_decimal(const uint32_t* a, size_t na)
+{
+    limbs_t x(a, a + bn_normalize(a, na));
+    std::string result;
+    // peel off 9 digits at a time
+    while (!x.empty())
+    {
+        uint64_t rem = 0;
+        for (size_t i = x.size(); i-- > 0;)
+        {
+            const uint64_t cur = (rem << 32) | x[i];
+            x[i] = uint32_t(cur / 1000000000u);
+            rem = cur % 1000000000u;
+        }
+        x.resize(bn_normalize(x.data(), x.size()));
+        for (int d = 0; d < 9 && (!x.empty() || rem); ++d, rem /= 10)
+            result.push_back(char('0' + rem % 10));
+    }
+    if (result.empty()) result = "0";
+    std::reverse(result.begin(), result.end());
+    return result;
+}
@@ -0,0 +1,7 @@
+(define inloop (lambda (v x n) (begin (vset! v n (% x n)) (+ (* 10 (vref v (- n 1))) (/ x n)))))
+(define mnloop (lambda (v x n) (cond (eq n 1) (inloop v x n) (1) (mnloop v (inloop v x n) (- n 1)))))
+(define otloop (lambda (v x n) (cond (eq n 10) (print) (1) (begin (define r (mnloop v x n)) (print r) (otloop v r (- n 1))))))
+(define l1 (make-vector 39 1))
+(vset! l1 0 0)
+(vset! l1 1 2)
+(otloop l1 0 38)
@@ -0,0 +1,11 @@
+(define sh (lambda (a) (begin (define a 9) (lambda (x) (+ x a)))))
+(define g (sh 1))
+(print (g 0))
+(print)
+(define rd (lambda (a b) (begin (define a (* a 10)) (+ a b))))
+(print (rd 2 3))
+(print)
+(define ad (lambda (a) (lambda (x) (+ x a))))
+(define h (ad 5))
+(print (h 1))
+(print)
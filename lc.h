@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// liblc: the compiler (main.cc) and the VM (vm.cc) in-process, built with 'make liblc.a'.
+// Nothing goes through stdin/stdout, output is passed to a callback.
+
+namespace lc
+{
+
+// compiles lisp source to linked bytecode, the same bytecode main writes;
+// returns false with a message in 'error' if the source can't be compiled
+bool compile(const std::string& source, std::vector<std::string>& bytecode, std::string& error, bool optimize = false);
+
+// a cell read from the VM: Int values, lambda addresses and Vector/Hash sizes are in 'integer',
+// BigInts, Strings and Texts are in 'text'
+struct Value
+{
+    enum Type { Nil, Pair, Int, String, Lambda, Vector, BigInt, Text, Hash, Other };
+    Type type;
+    int64_t integer;
+    std::string text;
+};
+
+// the arguments and the result of a native function called by (native name args...), CALLN in bytecode;
+// arguments are read in place from the VM stack, so they stay valid when a return_* call runs the GC
+class NativeCall
+{
+public:
+    virtual size_t count() const = 0;
+    virtual Value::Type type(size_t i) const = 0;
+    // an Int argument
+    virtual int64_t integer(size_t i) const = 0;
+    // the bytes of a String/Text argument, the digits of an Int/BigInt one
+    virtual std::string text(size_t i) const = 0;
+    // the result replaces the arguments on the stack, it is Nil if the function sets none
+    virtual void return_nil() = 0;
+    virtual void return_integer(int64_t x) = 0;
+    virtual void return_text(const std::string& text) = 0;
+    virtual void return_argument(size_t i) = 0;
+    // panics the VM
+    virtual void fail(const std::string& message) = 0;
+
+protected:
+    ~NativeCall() { }
+};
+
+typedef std::function<void(NativeCall&)> NativeFunction;
+
+// where native functions are registered, a shared object loaded with Vm::load_natives (or vm -n) exports
+// extern "C" void lc_register(lc::Natives& natives), which defines its functions
+class Natives
+{
+public:
+    virtual void define(const std::string& name, NativeFunction function) = 0;
+
+protected:
+    ~Natives() { }
+};
+
+// a VM which keeps its heap, global env and code between runs, so definitions made by one run
+// can be used by the next ones
+class Vm
+{
+public:
+    // heap_cells covers both halves of the heap, it must be below 2^32 (heap references are 32 bit)
+    explicit Vm(size_t heap_cells = 100000, size_t stack_cells = 1000);
+    ~Vm();
+
+    // receives print output and panic messages, without a callback output is discarded
+    void on_output(std::function<void(const std::string&)> callback);
+    // runs linked bytecode after the code of previous runs, returns false if the VM panicked
+    bool run(const std::vector<std::string>& bytecode);
+    // compiles and runs source, compile errors are passed to the output callback
+    bool eval(const std::string& source);
+    // the values the last run left on the stack, the top of the stack is the last one
+    std::vector<Value> results() const;
+    // forgets all definitions and code, native functions stay registered
+    void reset();
+    // native functions may be registered before or between runs, pmap workers share them
+    void define_native(const std::string& name, NativeFunction function);
+    // returns false with a message in 'error' if the shared object can't be loaded or has no lc_register
+    bool load_natives(const std::string& path, std::string& error);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+}
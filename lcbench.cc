@@ -0,0 +1,72 @@
+// lcbench: latency of evaluating small programs in-process (liblc) vs piping them through ./main | ./vm
+// usage: ./lcbench [runs]
+
+#include "lc.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl;
+
+namespace
+{
+
+const char* PROGRAM = "(define fact (lambda (n) (cond (less n 2) 1 (1) (* n (fact (- n 1)))))) (fact 20)";
+
+double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// runs the program through the command line tools, returns its output
+std::string run_pipeline()
+{
+    FILE* pipe = popen((std::string("echo '") + PROGRAM + "' | ./main | ./vm").c_str(), "r");
+    if (!pipe) return "";
+    std::string output;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0) output.append(buffer, n);
+    pclose(pipe);
+    return output;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    const int runs = argc > 1 ? atoi(argv[1]) : 100;
+
+    lc::Vm vm;
+    std::string output;
+    vm.on_output([&output](const std::string& text) { output += text; });
+    double start = now_us();
+    for (int i = 0; i < runs; ++i)
+    {
+        vm.reset();
+        if (!vm.eval(PROGRAM))
+        {
+            cout << "eval failed: " << output << endl;
+            return 1;
+        }
+    }
+    const double in_process = (now_us() - start) / runs;
+    const std::vector<lc::Value> results = vm.results();
+    if (!results.empty())
+    {
+        const lc::Value& value = results.back();
+        cout << "result: " << (value.type == lc::Value::Int ? std::to_string(value.integer) : value.text) << endl;
+    }
+
+    start = now_us();
+    for (int i = 0; i < runs; ++i) run_pipeline();
+    const double pipeline = (now_us() - start) / runs;
+
+    cout << "in-process: " << in_process << " us/eval" << endl;
+    cout << "main | vm:  " << pipeline << " us/eval" << endl;
+    return 0;
+}
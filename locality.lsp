@@ -0,0 +1,25 @@
+(define dbl (lambda (l k) (cond (eq k 0) l (1) (dbl (append l l) (- k 1)))))
+(define base (dbl (cons 1 Nil) 17))
+(define spread (lambda (x acc) (cons (cons x (cons x (cons x Nil))) acc)))
+(define l (accum spread Nil base))
+(define base Nil)
+(gc)
+(gc)
+(define walk (lambda (k n) (cond (eq k 0) n (1) (walk (- k 1) (+ (+ n (length l)) (length (nth 131000 l)))))))
+(define copy (lambda (k n) (cond (eq k 0) n (1) (copy (- k 1) (+ n (length (append l Nil)))))))
+(define m0 (native cache-misses))
+(define t0 (native clock))
+(print (walk 40 0))
+(print)
+(print "length/nth us: ")
+(print (- (native clock) t0))
+(print)
+(define t0 (native clock))
+(print (copy 10 0))
+(print)
+(print "append us: ")
+(print (- (native clock) t0))
+(print)
+(print "cache misses: ")
+(print (native cache-misses))
+(print)
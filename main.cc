@@ -4,21 +4,34 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
 #include <memory>
+#include <mutex>
 #include <chrono>
 #include <cstring>
+#include <cstdio>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "lc.h"
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::shared_ptr;
 
+// everything but the lc API has internal linkage, so the compiler and the VM, which has a Cell of
+// its own, can be linked together into liblc
+namespace
+{
+
 struct Cell
 {
-    enum CellType { Symbol, Int, List, Nil } type;
+    enum CellType { Symbol, Int, List, Nil, Str } type;
     int as_int;
     std::vector<Cell> list;
-    std::string name;
+    std::string name; // symbol name, the text of a string literal or of an integer, which may exceed int range
 
     bool operator!=(const Cell& cell) { return type != cell.type; }
 
@@ -36,6 +49,7 @@ struct Cell
             {
                 type = Int;
                 as_int = atol(str);
+                name = x;
             }
             else
             {
@@ -48,6 +62,111 @@ struct Cell
     void compile(std::vector<std::string>&, std::vector<std::vector<std::string>>&) const;
 };
                                                                                                                                                                                 
+// the first error of a compilation, compiling stops after the form that set it
+std::string compile_error;
+
+// issue error in case symbol size is more than 7 characters:
+// it wont fit into the Cell in the VM
+// special form names never reach the VM, so only names emitted into bytecode are checked
+// TODO: mangle names to shorter strings
+
+const std::string& vm_name(const std::string& name)
+{
+    if (name.size() > 6 && compile_error.empty()) compile_error = "Long names are not supported: " + name;
+    return name;
+}
+
+// string literals are a single bytecode token, so spaces, newlines, tabs and backslashes are escaped
+std::string vm_string(const std::string& text)
+{
+    std::string result;
+    for (auto c : text)
+    {
+        if (c == ' ') result += "\\s";
+        else if (c == '\n') result += "\\n";
+        else if (c == '\t') result += "\\t";
+        else if (c == '\\') result += "\\\\";
+        else result += c;
+    }
+    return result;
+}
+
+// list, string and hash table functions implemented natively by the VM, calls to these names compile to a single opcode
+const std::map<std::string, std::string> builtins = {
+    { "length", "LEN" }, { "append", "APPEND" }, { "reverse", "REVERSE" }, { "map", "MAP" },
+    { "filter", "FILTER" }, { "accum", "ACCUM" }, { "nth", "NTH" }, { "pmap", "PMAP" },
+    { "slen", "SLEN" }, { "sref", "SREF" }, { "substr", "SUBSTR" }, { "concat", "CONCAT" },
+    { "scmp", "SCMP" }, { "sfind", "SFIND" },
+    { "make-hash", "MKHASH" }, { "hget", "HGET" }, { "hset!", "HSET" }, { "hdel!", "HDEL" }, { "hcount", "HCOUNT" }
+};
+
+// the lambdas enclosing the code being compiled, innermost last
+struct Scope
+{
+    std::set<std::string> bound;            // parameters, captured names and names defined so far
+    std::map<std::string, int> pending;     // defines of the body which haven't been compiled yet, by name
+    size_t frame_size;                      // env nodes in front of the top-level env: one per bound name (and define)
+    bool flat;                              // false if frame_size isn't known, lambdas created in it capture the whole env
+};
+std::vector<Scope> scopes;
+
+// builtin names the program defines at top level, calls to them are compiled as calls of the definition
+std::set<std::string> defined_builtins;
+
+// the top-level defines of a form, defines in lambdas are local to them
+void collect_global_defines(const Cell& cell)
+{
+    if (cell.type != Cell::List || cell.list.empty()) return;
+    if (cell.list[0].type == Cell::Symbol && cell.list[0].name == "lambda") return;
+    if (cell.list.size() > 2 && cell.list[0].type == Cell::Symbol && cell.list[0].name == "define" &&
+        builtins.count(cell.list[1].name))
+        defined_builtins.insert(cell.list[1].name);
+    for (auto& x : cell.list) collect_global_defines(x);
+}
+
+// a call of 'name' compiles to its opcode unless the program defines the name or a lambda binds it
+bool is_builtin(const std::string& name)
+{
+    if (!builtins.count(name) || defined_builtins.count(name)) return false;
+    for (auto& scope : scopes)
+        if (scope.bound.count(name)) return false;
+    return true;
+}
+
+// every symbol in a form, a superset of its free variables
+void collect_symbols(const Cell& cell, std::set<std::string>& symbols)
+{
+    if (cell.type == Cell::Symbol) symbols.insert(cell.name);
+    for (auto& x : cell.list) collect_symbols(x, symbols);
+}
+
+// counts the names a lambda body defines in its own env (defines in nested lambdas go to their envs);
+// returns false if a define might not run, e.g. it is in a cond, since its env nodes couldn't be counted
+bool collect_defines(const Cell& cell, bool unconditional, std::map<std::string, int>& names)
+{
+    if (cell.type != Cell::List || cell.list.empty()) return true;
+    const std::string head = cell.list[0].type == Cell::Symbol ? cell.list[0].name : "";
+    if (head == "lambda") return true;
+    if (head == "define")
+    {
+        if (!unconditional || cell.list.size() < 3) return false;
+        names[cell.list[1].name] += 1;
+        return collect_defines(cell.list[2], false, names);
+    }
+    for (size_t i = 1; i < cell.list.size(); ++i)
+        if (!collect_defines(cell.list[i], unconditional && head == "begin", names)) return false;
+    return collect_defines(cell.list[0], false, names);
+}
+
+// arithmetic and comparisons whose operands type inference (main -t) proved to be numbers, see TypeInference
+std::set<const Cell*> unchecked_ops;
+
+// the unchecked variant of an arithmetic instruction if the operands of 'cell' are known to be numbers
+std::string arith_op(const Cell& cell, const std::string& op)
+{
+    return unchecked_ops.count(&cell) ? op + ".i" : op;
+}
+
 void compile_args(const std::vector<Cell>& list, 
                         std::vector<std::string>& program,
                         std::vector<std::vector<std::string>>& functions)
@@ -59,7 +178,8 @@ void compile_args(const std::vector<Cell>& list,
 void Cell::compile(std::vector<std::string>& program,
                    std::vector<std::vector<std::string>>& functions) const
 {
-    if (type == Int) program.push_back("PUSHCI " + std::to_string(as_int));
+    if (type == Int) program.push_back("PUSHCI " + (name.empty() ? std::to_string(as_int) : name));
+    else if (type == Str) program.push_back("PUSHSTR " + vm_string(name));
     else if (type == Symbol)
     {
     	if (name == "Nil") program.push_back("PUSHNIL");    		
@@ -68,7 +188,7 @@ void Cell::compile(std::vector<std::string>& program,
 	        program.push_back("LOADENV");
 	        program.push_back("PUSHCAR");
 	        program.push_back("PUSHCAR");
-	        program.push_back("EQSI " + name);
+	        program.push_back("EQSI " + vm_name(name));
 	        program.push_back("RJNZ +6");
 	        program.push_back("POP");
 	        program.push_back("POP");
@@ -89,20 +209,20 @@ void Cell::compile(std::vector<std::string>& program,
         else if (list[0].type == Cell::Nil) program.push_back("PUSHNIL");
         else if (list[0].type == Cell::Symbol)
         {
-            if (list[0].name == "+") { compile_args(list, program, functions); program.push_back("ADD"); }
-            else if (list[0].name == "-") { compile_args(list, program, functions); program.push_back("SUB"); }
-            else if (list[0].name == "*") { compile_args(list, program, functions); program.push_back("MUL"); }
-            else if (list[0].name == "/") { compile_args(list, program, functions); program.push_back("DIV"); }
-            else if (list[0].name == "%") { compile_args(list, program, functions); program.push_back("MOD"); }
+            if (list[0].name == "+") { compile_args(list, program, functions); program.push_back(arith_op(*this, "ADD")); }
+            else if (list[0].name == "-") { compile_args(list, program, functions); program.push_back(arith_op(*this, "SUB")); }
+            else if (list[0].name == "*") { compile_args(list, program, functions); program.push_back(arith_op(*this, "MUL")); }
+            else if (list[0].name == "/") { compile_args(list, program, functions); program.push_back(arith_op(*this, "DIV")); }
+            else if (list[0].name == "%") { compile_args(list, program, functions); program.push_back(arith_op(*this, "MOD")); }
             else if (list[0].name == "less")
             {
                  compile_args(list, program, functions); 
-                 program.push_back("LT");
+                 program.push_back(arith_op(*this, "LT"));
             }
             else if (list[0].name == "eq")
             {
                  compile_args(list, program, functions); 
-                 program.push_back("EQ");
+                 program.push_back(arith_op(*this, "EQ"));
             }
             else if (list[0].name == "cons")
             {
@@ -123,9 +243,73 @@ void Cell::compile(std::vector<std::string>& program,
             else if (list[0].name == "define")
             {
                 list[2].compile(program, functions);
-                program.push_back("PUSHS " + list[1].name);
+                program.push_back("PUSHS " + vm_name(list[1].name));
                 program.push_back("CONS");
                 program.push_back("DEF");
+                // the lambda's env has one more node, later lambdas may capture the name
+                if (!scopes.empty())
+                {
+                    Scope& scope = scopes.back();
+                    scope.frame_size += 1;
+                    if (--scope.pending[list[1].name] == 0) scope.bound.insert(list[1].name);
+                }
+            }
+            else if (list[0].name == "make-vector")
+            {
+                compile_args(list, program, functions);
+                program.push_back("MKVEC");
+            }
+            else if (list[0].name == "vref")
+            {
+                compile_args(list, program, functions);
+                program.push_back("VREF");
+            }
+            else if (list[0].name == "vset!")
+            {
+                compile_args(list, program, functions);
+                program.push_back("VSET");
+            }
+            else if (list[0].name == "vlen")
+            {
+                compile_args(list, program, functions);
+                program.push_back("VLEN");
+            }
+            else if (list[0].name == "vsum")
+            {
+                compile_args(list, program, functions);
+                program.push_back("VSUM");
+            }
+            else if (list[0].name == "vadd!")
+            {
+                compile_args(list, program, functions);
+                program.push_back("VADD");
+            }
+            else if (list[0].name == "native")
+            {
+                // (native name args...) calls a function registered with the VM, the name isn't a symbol so it can be long
+                for (size_t i = 2; i < list.size(); ++i)
+                    list[i].compile(program, functions);
+                program.push_back("CALLN " + list[1].name + " " + std::to_string(list.size() - 2));
+            }
+            else if (list[0].name == "memo")
+            {
+                // (memo (lambda ...) [size]) caches results by argument values, the arity is taken from the lambda
+                const bool is_lambda = list.size() > 1 && list[1].type == Cell::List && list[1].list.size() > 2 &&
+                                       list[1].list[0].type == Cell::Symbol && list[1].list[0].name == "lambda";
+                if (!is_lambda)
+                {
+                    if (compile_error.empty()) compile_error = "memo expects a lambda";
+                    return;
+                }
+                list[1].compile(program, functions);
+                std::string memo = "MEMO " + std::to_string(list[1].list[1].list.size());
+                if (list.size() > 2 && list[2].type == Cell::Int) memo += " " + std::to_string(list[2].as_int);
+                program.push_back(memo);
+            }
+            else if (is_builtin(list[0].name))
+            {
+                compile_args(list, program, functions);
+                program.push_back(builtins.at(list[0].name));
             }
             else if (list[0].name == "func?")
             {
@@ -241,13 +425,38 @@ void Cell::compile(std::vector<std::string>& program,
                 {
                     func.push_back("LOADENV");
                     func.push_back("PUSHFS " + std::to_string(3 + args_count - i)); // 3 - PC, env and fp
-                    func.push_back("PUSHS " + list[1].list[i].name);
+                    func.push_back("PUSHS " + vm_name(list[1].list[i].name));
                     func.push_back("CONS");
                     func.push_back("CONS");
                     func.push_back("STOREENV");
                 }
+                // flat closure: the lambda captures the values of the enclosing lambda's bindings its body uses,
+                // anything else is looked up in the top-level env the enclosing env chain ends with.
+                // Names the enclosing lambda defines later must be found when the lambda runs (e.g. local
+                // recursive functions), a lambda using one keeps the whole env like top-level lambdas do
+                bool flat = scopes.empty() || scopes.back().flat;
+                Scope scope;
+                for (auto& x : list[1].list) scope.bound.insert(x.name);
+                std::vector<std::string> captured;
+                if (flat && !scopes.empty())
+                {
+                    std::set<std::string> symbols;
+                    collect_symbols(list[2], symbols);
+                    for (auto& name : symbols)
+                    {
+                        const auto pending = scopes.back().pending.find(name);
+                        if (pending != scopes.back().pending.end() && pending->second > 0) flat = false;
+                        else if (scopes.back().bound.count(name) && !scope.bound.count(name)) captured.push_back(name);
+                    }
+                    if (!flat) captured.clear();
+                }
+                scope.bound.insert(captured.begin(), captured.end());
+                scope.frame_size = args_count + captured.size();
+                scope.flat = flat && collect_defines(list[2], true, scope.pending);
                 // compile body
+                scopes.push_back(scope);
                 list[2].compile(func, functions);
+                scopes.pop_back();
                 if (args_count == 0)
                 {
                     func.push_back("SWAP 2");
@@ -262,7 +471,18 @@ void Cell::compile(std::vector<std::string>& program,
                 }
                 func.push_back("RET " + std::to_string(retcount));
                 functions.push_back(func);
-                program.push_back("PUSHL " + std::to_string(functions.size() - 1));
+                if (!flat || scopes.empty()) program.push_back("PUSHL " + std::to_string(functions.size() - 1));
+                else
+                {
+                    // the captured values are pushed like any other variable, so arguments can come from the stack
+                    std::string closure = "PUSHLC " + std::to_string(functions.size() - 1) + " " + std::to_string(scopes.back().frame_size);
+                    for (auto& name : captured)
+                    {
+                        Cell(name).compile(program, functions);
+                        closure += " " + name;
+                    }
+                    program.push_back(closure);
+                }
             }
             else // function call
             {
@@ -270,7 +490,8 @@ void Cell::compile(std::vector<std::string>& program,
                 Cell f(Symbol);
                 f.name = list[0].name;
                 f.compile(program, functions);
-                program.push_back("CALL");
+                // the argument count lets the VM verify stack depths, see VM::verify
+                program.push_back("CALL " + std::to_string(list.size() - 1));
             }
         }
     }
@@ -289,14 +510,28 @@ Cell parse_list(const char* input, const char** jumped_to = NULL)
             const char c = *cur;
             if (c == '(')
                 cell.list.push_back(parse_list(++cur, &cur));
+            else if (c == '"')
+            {
+                // string literal, \" \\ \n and \t are escapes
+                Cell str(Cell::Str);
+                for (cur++; *cur && *cur != '"'; cur++)
+                {
+                    char x = *cur;
+                    if (x == '\\' && cur[1])
+                    {
+                        x = *++cur;
+                        if (x == 'n') x = '\n';
+                        else if (x == 't') x = '\t';
+                    }
+                    str.name.push_back(x);
+                }
+                cell.list.push_back(str);
+                if (!*cur) break;
+            }
             else if (c == ')' || c == ' ' || c == '\t' || c == '\n')
             {
                 if (symbol_ready)
                 {   
-                    // issue error in case symbol size is more than 7 characters:
-                    // it wont fit into the Cell in the VM
-                    // TODO: mangle names to shorter strings
-                    if (symbol.size() > 6) { std::cout << "Long names are not supported: " << symbol << endl; exit(1); }
                     cell.list.push_back(Cell(symbol));
                     symbol_ready = false;
                     symbol.clear();
@@ -314,8 +549,10 @@ Cell parse_list(const char* input, const char** jumped_to = NULL)
             }
             cur++;
         }
-        return cell.list[0];
+        // empty input is an empty list
+        return cell.list.empty() ? Cell() : cell.list[0];
     }
+    return Cell();
 }
 
 std::vector<std::string> tokenize(const std::string x)
@@ -327,12 +564,14 @@ std::vector<std::string> tokenize(const std::string x)
     return strings;
 }
 
+// appends functions to the program and replaces lambda indices with addresses,
+// 'base' is the address of the program's first instruction (see streaming mode)
 void link(std::vector<std::string>& program,
-          std::vector<std::vector<std::string>>& functions)
+          std::vector<std::vector<std::string>>& functions, size_t base = 0)
 {
     std::vector<size_t> relocs;
     relocs.reserve(functions.size());
-    size_t program_size = program.size();
+    size_t program_size = base + program.size();
     for (auto& func : functions)
     {
         for (auto& line : func)
@@ -340,16 +579,16 @@ void link(std::vector<std::string>& program,
         relocs.push_back(program_size);
         program_size += func.size();
     }
-    for (size_t i = 0; i < relocs.size(); ++i)
+    // a single pass, so an address is never mistaken for the index of a later function
+    for (auto& line : program)
     {
-        for (auto& line : program)
+        auto tokens = tokenize(line);
+        if (!tokens.empty() && (tokens[0] == "PUSHL" || tokens[0] == "PUSHLC") && tokens[1] != "-1")
         {
-            auto tokens = tokenize(line);
-            if (!tokens.empty())
-                if (tokens[0] == "PUSHL")
-                    if (std::stoi(tokens[1]) == i)
-                        line = std::string("PUSHL ") + std::to_string(relocs[i]);
-        }        
+            tokens[1] = std::to_string(relocs[std::stoi(tokens[1])]);
+            line = tokens[0];
+            for (size_t i = 1; i < tokens.size(); ++i) line += " " + tokens[i];
+        }
     }
 }
 
@@ -395,7 +634,8 @@ std::vector<std::string> cond_optimize(const std::vector<std::string>& func)
             tokenize(f[i - 1])[0] == "RJZ")
         {
             auto tokens = tokenize(f[i - 2]);
-            if (tokens[0] == "PUSHCI" && std::stoi(tokens[1]) > 0)
+            if (tokens[0] == "PUSHCI" && tokens[1][0] != '-' && 
+                tokens[1].find_first_not_of("+0") != std::string::npos)
             {
                 f = remove_instructions(f, i - 2, 3);
                 i = 2;
@@ -424,30 +664,56 @@ std::vector<std::string> funarg_optimize(const std::vector<std::string>& func)
     auto f = func;
     const std::vector<std::string> bound_names = get_function_arguments(f);
 
-    // check this function doesn't produce lambda
-    // otherwise we can't remove argument binding to env
-    // but we still can use FP to take arguments from stack
+    // escape analysis: the env outlives the call only if the function creates a lambda capturing it (PUSHL),
+    // otherwise argument bindings can stay on the stack; flat closures (PUSHLC) copy the values they capture
+    // from the stack, so a binding is only put on the heap when a closure is created
+    // we still can use FP to take arguments from stack
     // rather than deferencing them from env
-    bool produces_lambda = false;
+    bool env_escapes = false, defines = false;
     for (auto line : f)
     {
         auto tokens = tokenize(line);
         if (tokens[0] == "PUSHL" && tokens[1] != "-1")
-            produces_lambda = true;
+            env_escapes = true;
+        if (tokens[0] == "DEF")
+            defines = true;
     }
+    // an argument the function defines again (PUSHS name, CONS, DEF) keeps its binding and its lookups,
+    // which find the new value in the env
+    std::set<std::string> redefined;
+    for (size_t i = 2; i < f.size(); ++i)
+        if (f[i] == "DEF" && f[i - 1] == "CONS" && tokenize(f[i - 2])[0] == "PUSHS")
+            redefined.insert(tokenize(f[i - 2])[1]);
 
-    if (!produces_lambda)
+    if (!env_escapes)
+    {
+        size_t unbound = 0;
         for (size_t i = 5; i < f.size(); ++i)
             if (f[i] == "STOREENV" &&
                 f[i - 1] == "CONS" &&
                 f[i - 2] == "CONS" &&
                 tokenize(f[i - 3])[0] == "PUSHS" &&
                 tokenize(f[i - 4])[0] == "PUSHFS" &&
-                f[i - 5] == "LOADENV")
+                f[i - 5] == "LOADENV" &&
+                !redefined.count(tokenize(f[i - 3])[1]))
             {
                 f = remove_instructions(f, i - 5, 6);
+                unbound += 1;
                 i = 4;       
             }
+        // the top-level env is fewer nodes down from closures created here
+        for (auto& line : f)
+        {
+            auto tokens = tokenize(line);
+            if (tokens[0] != "PUSHLC") continue;
+            tokens[2] = std::to_string(std::stoul(tokens[2]) - unbound);
+            line = tokens[0];
+            for (size_t i = 1; i < tokens.size(); ++i) line += " " + tokens[i];
+        }
+        // without bindings or defines the env isn't changed, the call can use the lambda's env itself
+        if (!defines && f.size() > 1 && f[0] == "LOADENV" && f[1] == "STOREENV")
+            f = remove_instructions(f, 0, 2);
+    }
 
     for (size_t i = 14; i < f.size(); ++i)
         if (f[i] == "POP" &&
@@ -468,7 +734,7 @@ std::vector<std::string> funarg_optimize(const std::vector<std::string>& func)
     {
         const std::string name = tokenize(f[i - 11])[1];
         auto it = std::find(bound_names.begin(), bound_names.end(), name);
-        if (it != bound_names.end())
+        if (it != bound_names.end() && !redefined.count(name))
         {
             size_t index = it - bound_names.begin();
             f = remove_instructions(f, i - 14, 14);
@@ -479,14 +745,16 @@ std::vector<std::string> funarg_optimize(const std::vector<std::string>& func)
     return f;
 }
 
+static size_t cond_removed_instructions = 0, funarg_removed_instructions = 0;
+
 // cond optimization: eliminate (PUSHCI 1, RJZ, POP)
 // functions argument optimization: eliminate defining/searching for arguments in the env
-void optimize(std::vector<std::string>& program,
-                std::vector<std::vector<std::string>>& functions)
+// functions are optimized independently, so each form's lambdas (from 'first' on) are done after it is compiled
+void optimize(std::vector<std::vector<std::string>>& functions, size_t first)
 {
-    size_t cond_removed_instructions = 0, funarg_removed_instructions = 0;
-    for (auto& func : functions)
+    for (size_t i = first; i < functions.size(); ++i)
     {
+        auto& func = functions[i];
         func = cond_optimize(func); 
         cond_removed_instructions += removed_instructions;
         removed_instructions = 0;
@@ -494,26 +762,360 @@ void optimize(std::vector<std::string>& program,
         funarg_removed_instructions += removed_instructions;
         removed_instructions = 0;
     }
-    cerr << "cond_optimized: removed " << cond_removed_instructions << " instructions" << endl;
-    cerr << "funarg_optimized: removed " << funarg_removed_instructions << " instructions" << endl;
 }
 
-std::vector<std::string> break_into_forms(const std::vector<std::string>& input)
+// type inference over a whole program (main -t): a value is known to be a number (Int or BigInt), may be
+// anything, or isn't known yet (Unreached, e.g. the parameter of a function not called so far)
+enum ValueType { Unreached, Number, Anything };
+
+const std::set<std::string> arith_names = { "+", "-", "*", "/", "%", "less", "eq" };
+// the builtins which always return a number
+const std::set<std::string> number_builtins = { "length", "slen", "sref", "scmp", "sfind", "hcount", "vlen", "vsum",
+                                                "func?", "null?", "int?", "str?" };
+
+// the names defined anywhere in a form
+void collect_all_defines(const Cell& cell, std::map<std::string, int>& names)
 {
-    std::string p = std::accumulate(input.begin(), input.end(), std::string(""));
-    std::vector<std::string> result;
-    size_t bracket_count = 0;
+    if (cell.type != Cell::List) return;
+    if (cell.list.size() > 2 && cell.list[0].type == Cell::Symbol && cell.list[0].name == "define")
+        names[cell.list[1].name] += 1;
+    for (auto& x : cell.list) collect_all_defines(x, names);
+}
+
+// Global functions are the top-level (define f (lambda ...)) of names defined once. Their parameter types
+// are joined over the calls to them and their result type is the type of their body, until nothing changes.
+// A function used as a value (passed to map, memo...) may be called with anything. Everything else is
+// Anything: the parameters of other lambdas, env lookups and the results of other calls.
+struct TypeInference
+{
+    struct Function
+    {
+        const Cell* lambda;
+        std::vector<ValueType> params;
+        ValueType result;
+        bool escapes;
+    };
+    std::map<std::string, Function> functions;
+    bool changed;
+
+    void join(ValueType& x, ValueType y)
+    {
+        if (y > x) { x = y; changed = true; }
+    }
+
+    void run(const std::vector<Cell>& forms)
+    {
+        std::map<std::string, int> defines;
+        for (auto& form : forms) collect_all_defines(form, defines);
+        for (auto& form : forms)
+            if (const Cell* lambda = global_lambda(form))
+                if (defines[form.list[1].name] == 1)
+                    functions[form.list[1].name] = Function{ lambda, std::vector<ValueType>(lambda->list[1].list.size(), Unreached), Unreached, false };
+        // the last pass marks the operations of the final types
+        do
+        {
+            changed = false;
+            unchecked_ops.clear();
+            for (auto& form : forms)
+            {
+                const Cell* lambda = global_lambda(form);
+                if (lambda && functions.count(form.list[1].name)) function_body(functions[form.list[1].name]);
+                else infer(form, std::map<std::string, ValueType>());
+            }
+        } while (changed);
+    }
+
+    static const Cell* global_lambda(const Cell& form)
+    {
+        if (form.type != Cell::List || form.list.size() < 3 || form.list[0].type != Cell::Symbol ||
+            form.list[0].name != "define" || form.list[1].type != Cell::Symbol) return nullptr;
+        const Cell& value = form.list[2];
+        if (value.type != Cell::List || value.list.size() < 3 || value.list[0].type != Cell::Symbol ||
+            value.list[0].name != "lambda") return nullptr;
+        return &value;
+    }
+
+    void function_body(Function& function)
+    {
+        const Cell& lambda = *function.lambda;
+        std::map<std::string, ValueType> locals;
+        for (size_t i = 0; i < lambda.list[1].list.size(); ++i)
+            locals[lambda.list[1].list[i].name] = function.escapes ? Anything : function.params[i];
+        join(function.result, lambda_body(lambda, locals));
+    }
+
+    // names the body defines shadow the parameters and are Anything
+    ValueType lambda_body(const Cell& lambda, std::map<std::string, ValueType>& locals)
+    {
+        std::map<std::string, int> defines;
+        collect_all_defines(lambda.list[2], defines);
+        for (auto& x : defines) locals[x.first] = Anything;
+        return infer(lambda.list[2], locals);
+    }
+
+    ValueType infer(const Cell& cell, const std::map<std::string, ValueType>& locals)
+    {
+        if (cell.type == Cell::Int) return Number;
+        if (cell.type == Cell::Symbol)
+        {
+            const auto local = locals.find(cell.name);
+            if (local != locals.end()) return local->second;
+            const auto function = functions.find(cell.name);
+            if (function != functions.end() && !function->second.escapes)
+            {
+                function->second.escapes = true;
+                changed = true;
+            }
+            return Anything;
+        }
+        if (cell.type != Cell::List || cell.list.empty()) return Anything;
+        const std::vector<Cell>& list = cell.list;
+        if (list[0].type == Cell::Int) return Number;
+        if (list[0].type != Cell::Symbol) return Anything;
+        const std::string& head = list[0].name;
+        std::vector<ValueType> args;
+        if (head == "lambda")
+        {
+            if (list.size() < 3) return Anything;
+            std::map<std::string, ValueType> inner = locals;
+            for (auto& x : list[1].list) inner[x.name] = Anything;
+            lambda_body(cell, inner);
+            return Anything;
+        }
+        if (head == "native")
+        {
+            for (size_t i = 2; i < list.size(); ++i) infer(list[i], locals);
+            return Anything;
+        }
+        // the name of a define isn't a use of it
+        if (head == "define")
+            return list.size() > 2 ? infer(list[2], locals) : Anything;
+        for (size_t i = 1; i < list.size(); ++i) args.push_back(infer(list[i], locals));
+        if (arith_names.count(head))
+        {
+            if (args.size() == 2 && args[0] == Number && args[1] == Number) unchecked_ops.insert(&cell);
+            return Number;
+        }
+        const bool builtin = !locals.count(head) && !defined_builtins.count(head);
+        if (builtin && number_builtins.count(head)) return Number;
+        if (head == "begin") return args.empty() ? Anything : args.back();
+        if (head == "cond")
+        {
+            ValueType result = Unreached;
+            for (size_t i = 1; i < args.size(); i += 2) result = std::max(result, args[i]);
+            // without a true condition, cond leaves the last condition's value
+            if (!args.empty()) result = std::max(result, args[(args.size() - 1) & ~size_t(1)]);
+            return result;
+        }
+        if ((builtin && builtins.count(head)) || head == "cons" || head == "car" || head == "cdr" || head == "make-vector" ||
+            head == "vref" || head == "vset!" || head == "vadd!" || head == "memo" || head == "gc" || head == "print")
+            return Anything;
+        // a call, unless a local has the function's name
+        const auto function = functions.find(head);
+        if (locals.count(head) || function == functions.end()) return Anything;
+        Function& callee = function->second;
+        if (args.size() != callee.params.size())
+        {
+            if (!callee.escapes) changed = true;
+            callee.escapes = true;
+        }
+        else
+            for (size_t i = 0; i < args.size(); ++i) join(callee.params[i], args[i]);
+        return callee.result;
+    }
+};
+
+// whether each arithmetic operation of a form is unchecked, compiled code depends on it with main -t
+void unchecked_signature(const Cell& cell, std::string& signature)
+{
+    if (cell.type != Cell::List) return;
+    if (!cell.list.empty() && cell.list[0].type == Cell::Symbol && arith_names.count(cell.list[0].name))
+        signature += unchecked_ops.count(&cell) ? '1' : '0';
+    for (auto& x : cell.list) unchecked_signature(x, signature);
+}
+
+// canonical text of a parsed form, forms differing only in layout have the same text
+std::string normalize(const Cell& cell)
+{
+    if (cell.type == Cell::Str) return "\"" + vm_string(cell.name) + "\"";
+    if (cell.type != Cell::List) return cell.name;
+    std::string text = "(";
+    for (size_t i = 0; i < cell.list.size(); ++i)
+        text += (i ? " " : "") + normalize(cell.list[i]);
+    return text + ")";
+}
+
+// adds 'offset' to the lambda indices of PUSHL/PUSHLC instructions, PUSHL -1 is not a lambda
+void rebase_lambdas(std::vector<std::string>& code, long offset)
+{
+    for (auto& line : code)
+    {
+        if (line.compare(0, 6, "PUSHL ") == 0 && line != "PUSHL -1")
+            line = "PUSHL " + std::to_string(std::stol(line.substr(6)) + offset);
+        else if (line.compare(0, 7, "PUSHLC ") == 0)
+        {
+            const size_t end = line.find(' ', 7);
+            line = "PUSHLC " + std::to_string(std::stol(line.substr(7, end - 7)) + offset) + line.substr(end);
+        }
+    }
+}
+
+const size_t COMPILE_CACHE_MAX_BYTES = 16 << 20;
+
+// on-disk cache of compiled top-level forms, keyed by a hash of the compiler build, the flags and the
+// form's canonical text. An entry holds the form's code and its (optimized) lambdas before linking,
+// with lambda indices relative to the form's first lambda, so link() relocates cached code like fresh code.
+struct CompileCache
+{
+    std::string dir;
+    std::string flags;
+    size_t hits, misses, evicted;
+
+    bool typed;
+
+    CompileCache(const std::string& dir, const std::string& flags) :
+        dir(dir), flags(std::string(__DATE__ " " __TIME__ " ") + flags), hits(0), misses(0), evicted(0),
+        typed(flags.find("-t") != std::string::npos)
+    {
+        mkdir(dir.c_str(), 0755);
+    }
+
+    std::string key(const Cell& form) const { return flags + " " + normalize(form); }
+
+    std::string path(const std::string& key) const
+    {
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        for (unsigned char c : key) hash = (hash ^ c) * 1099511628211ull;
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+        return dir + "/" + name;
+    }
+
+    // appends a cached form to the program, returns false on a miss
+    bool load(const std::string& key, std::vector<std::string>& program, std::vector<std::vector<std::string>>& functions)
+    {
+        const std::string file = path(key);
+        std::ifstream in(file);
+        std::string line;
+        size_t code_size = 0, function_count = 0, cond_removed = 0, funarg_removed = 0;
+        // the key is stored too, so hash collisions are misses
+        if (!std::getline(in, line) || line != key || !std::getline(in, line) ||
+            !(std::istringstream(line) >> code_size >> function_count >> cond_removed >> funarg_removed))
+        {
+            misses += 1;
+            return false;
+        }
+        std::vector<std::string> code(code_size);
+        for (auto& x : code) std::getline(in, x);
+        std::vector<std::vector<std::string>> lambdas(function_count);
+        for (auto& func : lambdas)
+        {
+            size_t size = 0;
+            if (std::getline(in, line)) size = std::stoul(line);
+            func.resize(size);
+            for (auto& x : func) std::getline(in, x);
+        }
+        if (!in)
+        {
+            misses += 1;
+            return false;
+        }
+        rebase_lambdas(code, functions.size());
+        for (auto& func : lambdas) rebase_lambdas(func, functions.size());
+        program.insert(program.end(), code.begin(), code.end());
+        functions.insert(functions.end(), lambdas.begin(), lambdas.end());
+        cond_removed_instructions += cond_removed;
+        funarg_removed_instructions += funarg_removed;
+        // the modification time orders entries for eviction
+        utime(file.c_str(), nullptr);
+        hits += 1;
+        return true;
+    }
+
+    // saves the code compiled for a form, starting at program[code_start] and functions[first]
+    void store(const std::string& key, const std::vector<std::string>& program, size_t code_start,
+               const std::vector<std::vector<std::string>>& functions, size_t first, size_t cond_removed, size_t funarg_removed)
+    {
+        std::ofstream out(path(key));
+        out << key << endl << program.size() - code_start << " " << functions.size() - first << " "
+            << cond_removed << " " << funarg_removed << endl;
+        std::vector<std::string> code(program.begin() + code_start, program.end());
+        rebase_lambdas(code, -long(first));
+        for (const auto& x : code) out << x << endl;
+        for (size_t i = first; i < functions.size(); ++i)
+        {
+            std::vector<std::string> func = functions[i];
+            rebase_lambdas(func, -long(first));
+            out << func.size() << endl;
+            for (const auto& x : func) out << x << endl;
+        }
+    }
+
+    // removes the least recently used entries until the cache fits into COMPILE_CACHE_MAX_BYTES
+    void trim()
+    {
+        std::vector<std::pair<time_t, std::pair<std::string, size_t>>> entries;
+        size_t total = 0;
+        if (DIR* d = opendir(dir.c_str()))
+        {
+            while (dirent* entry = readdir(d))
+            {
+                const std::string file = dir + "/" + entry->d_name;
+                struct stat info;
+                if (entry->d_name[0] == '.' || stat(file.c_str(), &info) || !S_ISREG(info.st_mode)) continue;
+                entries.push_back({ info.st_mtime, { file, size_t(info.st_size) } });
+                total += info.st_size;
+            }
+            closedir(d);
+        }
+        std::sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total > COMPILE_CACHE_MAX_BYTES; ++i)
+        {
+            remove(entries[i].second.first.c_str());
+            total -= entries[i].second.second;
+            evicted += 1;
+        }
+    }
+};
+
+// splits input into top-level forms as it arrives, lines are joined without separators
+struct FormReader
+{
+    size_t bracket_count;
     std::string form;
-    char prevc = 'x'; // any non whitespace character will do
-    for (auto c : p)
+    char prevc;
+    bool in_string, escaped;
+
+    FormReader() : bracket_count(0), prevc('x'), in_string(false), escaped(false) {} // any non whitespace prevc will do
+
+    // returns the forms completed by 'input'
+    std::vector<std::string> feed(const std::string& input);
+};
+
+std::vector<std::string> FormReader::feed(const std::string& input)
+{
+    std::vector<std::string> result;
+    for (auto c : input)
     {
+        // string literals are kept as they are
+        if (in_string)
+        {
+            form += c;
+            if (escaped) escaped = false;
+            else if (c == '\\') escaped = true;
+            else if (c == '"') in_string = false;
+            prevc = c;
+            continue;
+        }
+        if (c == '"') in_string = true;
         if ((isspace(c) && !isspace(prevc)) || !isspace(c)) form += c;
         if (c == '(') bracket_count += 1;
         else if (c == ')') bracket_count -= 1;
 
         if (!bracket_count && !form.empty())
         {
-            result.push_back(form);
+            // whitespace between forms isn't a form
+            if (form.find_first_not_of(" \t\r\n") != std::string::npos) result.push_back(form);
             form.clear();
         }
         prevc = c;
@@ -521,29 +1123,179 @@ std::vector<std::string> break_into_forms(const std::vector<std::string>& input)
     return result;
 }
 
-int main(int argc, char** argv)
+std::vector<std::string> break_into_forms(const std::vector<std::string>& input)
+{
+    FormReader reader;
+    std::vector<std::string> result;
+    for (const auto& line : input)
+    {
+        const auto forms = reader.feed(line);
+        result.insert(result.end(), forms.begin(), forms.end());
+    }
+    return result;
+}
+
+// compiles and optionally optimizes a form, unless it is cached
+void compile_form(const Cell& cell, bool optimized, CompileCache* cache,
+                  std::vector<std::string>& program, std::vector<std::vector<std::string>>& functions)
 {
-    // read input program
+    collect_global_defines(cell);
+    std::string key = cache ? cache->key(cell) : "";
+    // the same form compiles differently once the program defines a builtin's name
+    for (auto& name : defined_builtins) key += " " + name;
+    if (cache && cache->typed) unchecked_signature(cell, key += " ");
+    if (cache && cache->load(key, program, functions)) return;
+    const size_t code_start = program.size(), first = functions.size();
+    const size_t cond_removed = cond_removed_instructions, funarg_removed = funarg_removed_instructions;
+    cell.compile(program, functions);
+    if (optimized) optimize(functions, first);
+    if (cache && compile_error.empty())
+        cache->store(key, program, code_start, functions, first,
+                     cond_removed_instructions - cond_removed, funarg_removed_instructions - funarg_removed);
+}
+
+void compile_form(const std::string& form, bool optimized, CompileCache* cache,
+                  std::vector<std::string>& program, std::vector<std::vector<std::string>>& functions)
+{
+    compile_form(parse_list(form.c_str()), optimized, cache, program, functions);
+}
+
+// each form is linked and written as soon as it is complete, a VM reading the output as a stream (vm -s)
+// runs it right away. The form's lambdas come first, behind a jump, so they have been read by the time
+// the form's code creates them, even when native code (map, accum...) calls them back.
+bool compile_stream(std::istream& in, bool optimized, CompileCache* cache)
+{
+    FormReader reader;
+    size_t address = 0;
     std::string line;
-    std::vector<std::string> input;
-    while (std::getline(std::cin, line))
-       input.push_back(line);
+    while (std::getline(in, line))
+        for (const auto& form : reader.feed(line))
+        {
+            std::vector<std::string> code, program;
+            std::vector<std::vector<std::string>> functions;
+            compile_form(form, optimized, cache, code, functions);
+            if (!compile_error.empty()) return false;
+            size_t lambdas_size = 0;
+            for (const auto& func : functions) lambdas_size += func.size();
+            if (lambdas_size) program.push_back("RJMP +" + std::to_string(lambdas_size + 1));
+            // the code is linked as the last function
+            functions.push_back(code);
+            link(program, functions, address);
+            for (const auto& x : program)
+                cout << x << '\n';
+            cout.flush();
+            address += program.size();
+        }
+    cout << "FIN" << endl;
+    return true;
+}
+
+// compiles and links a whole program, given as lines; 'typed' infers types over the program first, the
+// program must be complete: its functions are compiled for the calls it makes
+std::vector<std::string> compile_program(const std::vector<std::string>& lines, bool optimized, CompileCache* cache,
+                                         bool typed = false)
+{
     // reorganize input to have each form on the separate line
-    input = break_into_forms(input);
+    const std::vector<std::string> input = break_into_forms(lines);
+    std::vector<Cell> forms;
+    for (auto& form : input)
+        forms.push_back(parse_list(form.c_str()));
+    // functions defined before a builtin's name is defined may call the definition too
+    defined_builtins.clear();
+    for (auto& form : forms) collect_global_defines(form);
+    if (typed) TypeInference().run(forms);
     std::vector<std::string> program;
     std::vector<std::vector<std::string>> functions;
-    // compile each form
-    for (auto form : input)
-        parse_list(form.c_str()).compile(program, functions);
+    for (auto& form : forms)
+    {
+        compile_form(form, optimized, cache, program, functions);
+        // the first error ends the compilation, later forms may depend on the failed one
+        if (!compile_error.empty()) break;
+    }
+    unchecked_ops.clear();
     program.push_back("FIN");
-    // optionally optimize the program
-    if (argc > 1 && strcmp(argv[1],"-o") == 0)
-        optimize(program, functions);
     // link program
     link(program, functions);
+    return program;
+}
+
+// the compiler keeps its state (compile_error, scopes, unchecked_ops, the optimizer counters) in globals,
+// so compilations on different threads take turns
+std::mutex compile_lock;
+
+} // namespace
+
+bool lc::compile(const std::string& source, std::vector<std::string>& bytecode, std::string& error, bool optimize)
+{
+    std::lock_guard<std::mutex> lock(compile_lock);
+    std::istringstream in(source);
+    std::string line;
+    std::vector<std::string> lines;
+    while (std::getline(in, line))
+        lines.push_back(line);
+    compile_error.clear();
+    bytecode = compile_program(lines, optimize, nullptr);
+    error = compile_error;
+    return error.empty();
+}
+
+#ifndef LC_LIBRARY
+int main(int argc, char** argv)
+{
+    // main [-o] [-t] [-c cache_dir] [-s]
+    bool optimized = false, streaming = false, typed = false;
+    std::string cache_dir;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0) optimized = true;
+        else if (strcmp(argv[i], "-t") == 0) typed = true;
+        else if (strcmp(argv[i], "-s") == 0) streaming = true;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) cache_dir = argv[++i];
+    }
+    std::unique_ptr<CompileCache> cache(cache_dir.empty() ? nullptr : new CompileCache(cache_dir,
+        std::string(optimized ? "-o" : "") + (typed && !streaming ? " -t" : "")));
+    std::vector<std::string> program;
+    if (streaming) compile_stream(std::cin, optimized, cache.get());
+    else
+    {
+        // read input program
+        std::string line;
+        std::vector<std::string> input;
+        while (std::getline(std::cin, line))
+           input.push_back(line);
+        program = compile_program(input, optimized, cache.get(), typed);
+    }
+    if (!compile_error.empty())
+    {
+        cout << compile_error << endl;
+        return 1;
+    }
+    if (optimized)
+    {
+        cerr << "cond_optimized: removed " << cond_removed_instructions << " instructions" << endl;
+        cerr << "funarg_optimized: removed " << funarg_removed_instructions << " instructions" << endl;
+    }
+    if (typed && !streaming)
+    {
+        size_t arithmetic = 0, unchecked = 0;
+        for (auto& x : program)
+        {
+            const std::string op = x.substr(0, x.find(' '));
+            if (op == "ADD" || op == "SUB" || op == "MUL" || op == "DIV" || op == "MOD" || op == "LT" || op == "EQ") arithmetic += 1;
+            else if (op.size() > 2 && op.compare(op.size() - 2, 2, ".i") == 0) arithmetic += 1, unchecked += 1;
+        }
+        cerr << "typed: " << unchecked << " of " << arithmetic << " arithmetic instructions unchecked ("
+             << (arithmetic ? 100 * unchecked / arithmetic : 0) << "%)" << endl;
+    }
+    if (cache)
+    {
+        cache->trim();
+        cerr << "compile cache: " << cache->hits << " hits, " << cache->misses << " misses, " << cache->evicted << " evicted" << endl;
+    }
     // print bytecode
     for (auto x : program)
         cout << x << endl;
     return 0;
 }
+#endif
 
@@ -0,0 +1,82 @@
+// example native functions for (native name args...), build with 'make natives.so' and load with
+// ./vm -n ./natives.so or lc::Vm::load_natives
+
+#include "lc.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+// (native fnv1a s): the 32 bit FNV-1a hash of a string
+void fnv1a(lc::NativeCall& call)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : call.text(0))
+        hash = (hash ^ c) * 16777619u;
+    call.return_integer(hash);
+}
+
+// (native parse-int s): the integer at the start of a string, Nil if there is none
+void parse_int(lc::NativeCall& call)
+{
+    const std::string text = call.text(0);
+    char* end = nullptr;
+    const long long x = std::strtoll(text.c_str(), &end, 10);
+    if (end == text.c_str()) call.return_nil();
+    else call.return_integer(x);
+}
+
+// (native repeat s n): s repeated n times
+void repeat(lc::NativeCall& call)
+{
+    if (call.integer(1) < 0) return call.fail("repeat: negative count");
+    const std::string text = call.text(0);
+    std::string result;
+    for (int64_t i = 0; i < call.integer(1); ++i) result += text;
+    call.return_text(result);
+}
+
+// (native clock): microseconds since an arbitrary point, for timing parts of a program
+void clock_us(lc::NativeCall& call)
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    call.return_integer(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+}
+
+// (native cache-misses): hardware cache misses of this thread counted since the first call,
+// -1 where the kernel or the CPU doesn't provide the counter
+void cache_misses(lc::NativeCall& call)
+{
+    static thread_local int counter = -2;
+    if (counter == -2)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    uint64_t count = 0;
+    if (counter < 0 || read(counter, &count, sizeof(count)) != sizeof(count)) return call.return_integer(-1);
+    call.return_integer(count);
+}
+
+}
+
+extern "C" void lc_register(lc::Natives& natives)
+{
+    natives.define("fnv1a", fnv1a);
+    natives.define("parse-int", parse_int);
+    natives.define("repeat", repeat);
+    natives.define("clock", clock_us);
+    natives.define("cache-misses", cache_misses);
+}
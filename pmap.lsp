@@ -0,0 +1,6 @@
+(define faux (lambda (x a) (cond (eq x 1) a (1) (faux (- x 1) (* x a)))))
+(define factl (lambda (x) (faux x 1)))
+(define range (lambda (a b) (cond (eq a b) Nil (1) (cons a (range (+ a 1) b)))))
+(define sumf (lambda (x) (% (factl (+ 120 (% x 30))) 1000003)))
+(print (accum (lambda (x y) (+ x y)) 0 (pmap sumf (range 0 96))))
+(print)
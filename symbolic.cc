@@ -8,93 +8,425 @@ using std::cout;
 using std::cerr;
 using std::endl;
 
-Expression::Expression() {}
+uint32_t NodeTable::add(const Node& node)
+{
+	nodes.push_back(node);
+	printed.emplace_back();
+	is_printed.push_back(false);
+	simplified.push_back(UINT32_MAX);
+	return nodes.size() - 1;
+}
 
-Expression::Expression(const Symbol& x) 
+uint32_t NodeTable::number(int128_t x)
 {
-	op = UNDEFINED;
-	symbols.clear();
-	symbols.push_back(x);
+	auto found = numbers.find(x);
+	if (found != numbers.end()) return found->second;
+	Node node;
+	node.type = Node::NUMERIC;
+	node.op = UNDEFINED;
+	node.value = x;
+	return numbers[x] = add(node);
 }
 
-Expression Expression::eval()
+uint32_t NodeTable::name(const std::string& x)
+{
+	auto found = names.find(x);
+	if (found != names.end()) return found->second;
+	Node node;
+	node.type = Node::STRING;
+	node.op = UNDEFINED;
+	node.name = x;
+	return names[x] = add(node);
+}
+
+uint32_t NodeTable::apply(Op op, uint32_t left, uint32_t right)
+{
+	const uint64_t key = (uint64_t(left) << 32) | right;
+	auto found = applied[op].find(key);
+	if (found != applied[op].end()) return found->second;
+	Node node;
+	node.type = Node::EXPRESSION;
+	node.op = op;
+	node.left = left;
+	node.right = right;
+	return applied[op][key] = add(node);
+}
+
+// the value of 'op' on two numbers, false if it has none (division by 0) or depends on the width of the operands
+static bool fold(Op op, const int128_t& x, const int128_t& y, int128_t& result)
+{
+	switch (op)
+	{
+	case ADD: result = x + y; return true;
+	case SUB: result = x - y; return true;
+	case MUL: result = x * y; return true;
+	case DIV: if (y == 0) return false; result = x / y; return true;
+	case REM: if (y == 0) return false; result = x % y; return true;
+	case AND: result = x & y; return true;
+	case OR: result = x | y; return true;
+	case XOR: result = x ^ y; return true;
+	case SHL: if (y < 0 || y > 127) return false; result = x << int(y); return true;
+	case SHR: if (y < 0 || y > 127) return false; result = x >> int(y); return true;
+	case EQ: result = x == y; return true;
+	case NE: result = x != y; return true;
+	case LT: result = x < y; return true;
+	case LE: result = x <= y; return true;
+	case GT: result = x > y; return true;
+	case GE: result = x >= y; return true;
+	default: return false;
+	}
+}
+
+static bool is_commutative(Op op) { return op == ADD || op == MUL || op == AND || op == OR || op == XOR || op == EQ || op == NE; }
+static bool is_associative(Op op) { return op == ADD || op == MUL || op == AND || op == OR || op == XOR; }
+
+// 'op' applied to two simplified nodes
+uint32_t NodeTable::combine(Op op, uint32_t a, uint32_t b)
+{
+	// nodes is appended to below, so nodes are read by id
+	auto numeric = [&](uint32_t id) { return nodes[id].type == Node::NUMERIC; };
+	// an operation with a constant right operand
+	auto with_constant = [&](uint32_t id, Op op) { return nodes[id].type == Node::EXPRESSION && nodes[id].op == op && numeric(nodes[id].right); };
+	int128_t result;
+	if (numeric(a) && numeric(b) && fold(op, nodes[a].value, nodes[b].value, result)) return number(result);
+	if (op == SUB && numeric(b)) return combine(ADD, a, number(-nodes[b].value));
+	// constants go right, other operands in the order they were created
+	if (is_commutative(op) && !numeric(b) && (numeric(a) || a > b)) std::swap(a, b);
+	if (a == b)
+	{
+		if (op == AND || op == OR) return a;
+		if (op == SUB || op == XOR || op == NE || op == LT || op == GT) return number(0);
+		if (op == EQ || op == LE || op == GE) return number(1);
+	}
+	if (numeric(b))
+	{
+		const int128_t value = nodes[b].value;
+		if (value == 0 && (op == ADD || op == OR || op == XOR || op == SHL || op == SHR || op == USHR)) return a;
+		if (value == 1 && (op == MUL || op == DIV)) return a;
+		if (value == 0 && (op == MUL || op == AND)) return number(0);
+		// (x + 1) + 2 = x + 3
+		if (is_associative(op) && with_constant(a, op) && fold(op, nodes[nodes[a].right].value, value, result))
+			return combine(op, nodes[a].left, number(result));
+		// (x + 1) * 8 = x * 8 + 8, so addresses computed from the same base differ by a constant
+		if (op == MUL && with_constant(a, ADD))
+		{
+			const uint32_t left = nodes[a].left;
+			const int128_t offset = nodes[nodes[a].right].value * value;
+			return combine(ADD, combine(MUL, left, b), number(offset));
+		}
+	}
+	// (x + 1) + y = (x + y) + 1
+	else if (op == ADD && with_constant(a, ADD))
+	{
+		const uint32_t left = nodes[a].left, right = nodes[a].right;
+		return combine(ADD, combine(ADD, left, b), right);
+	}
+	else if (op == ADD && with_constant(b, ADD))
+	{
+		const uint32_t left = nodes[b].left, right = nodes[b].right;
+		return combine(ADD, combine(ADD, a, left), right);
+	}
+	return apply(op, a, b);
+}
+
+uint32_t NodeTable::simplify(uint32_t id)
+{
+	// operands are simplified before the expressions using them, like print
+	std::vector<uint32_t> work(1, id);
+	while (!work.empty())
+	{
+		const uint32_t top = work.back();
+		if (simplified[top] != UINT32_MAX)
+		{
+			work.pop_back();
+			continue;
+		}
+		if (nodes[top].type != Node::EXPRESSION)
+		{
+			work.pop_back();
+			simplified[top] = top;
+			continue;
+		}
+		const uint32_t left = nodes[top].left, right = nodes[top].right;
+		if (simplified[left] == UINT32_MAX || simplified[right] == UINT32_MAX)
+		{
+			if (simplified[left] == UINT32_MAX) work.push_back(left);
+			if (simplified[right] == UINT32_MAX) work.push_back(right);
+			continue;
+		}
+		work.pop_back();
+		const uint32_t result = combine(nodes[top].op, simplified[left], simplified[right]);
+		simplified[top] = result;
+		simplified[result] = result;
+	}
+	return simplified[id];
+}
+
+std::string NodeTable::definition(uint32_t id) const
 {
+	const Node& node = nodes[id];
+	if (node.type == Node::NUMERIC)
+	{
+		std::stringstream stream;
+		if (node.value > 0xFFFFFF) stream << "0x" << std::hex;
+		stream << node.value;
+		return stream.str();
+	}
+	else if (node.type == Node::STRING) return node.name;
+	return std::string("(") + printed[node.left] + op_strings[node.op] + printed[node.right] + ")";
 }
 
-bool Expression::is_numeric() const
+const std::string& NodeTable::print(uint32_t id)
 {
-	if (symbols.size() == 1 && symbols[0].is_numeric()) return true;
-	else return false;
+	// operands are printed before the expressions using them without recursion, traces nest deeply
+	std::vector<uint32_t> work(1, id);
+	while (!work.empty())
+	{
+		const uint32_t top = work.back();
+		const Node& node = nodes[top];
+		if (is_printed[top]) work.pop_back();
+		else if (node.type == Node::EXPRESSION && (!is_printed[node.left] || !is_printed[node.right]))
+		{
+			if (!is_printed[node.left]) work.push_back(node.left);
+			if (!is_printed[node.right]) work.push_back(node.right);
+		}
+		else
+		{
+			work.pop_back();
+			printed[top] = definition(top);
+			if (node.type == Node::EXPRESSION && printed[top].size() > PRINT_LIMIT)
+			{
+				printed[top] = "@" + std::to_string(top);
+				references.push_back(top);
+			}
+			is_printed[top] = true;
+		}
+	}
+	return printed[id];
 }
 
+Expression::Expression() : id(nodes.name("")) {}
+Expression::Expression(const std::string& x) : id(nodes.name(x)) {}
+Expression::Expression(int128_t x) : id(nodes.number(x)) {}
+
+Expression Expression::eval()
+{
+	Expression e(*this);
+	e.id = nodes.simplify(id);
+	return e;
+}
+
+bool Expression::is_numeric() const { return nodes[id].type == Node::NUMERIC; }
+
 template<Op op>
 Expression op_func(const Expression& e, const Expression& x)
 {
-	Expression expr;
-	expr.op = op;
-	expr.symbols.push_back(e);
-	expr.symbols.push_back(x);
+	Expression expr(e);
+	expr.id = nodes.apply(op, e.id, x.id);
 	return expr;
 }
 
-Expression Expression::operator+(const Expression& x) { return op_func<ADD>(*this, x); }
-Expression Expression::operator-(const Expression& x) { return op_func<SUB>(*this, x); }
-Expression Expression::operator*(const Expression& x) { return op_func<MUL>(*this, x); }
-Expression Expression::operator/(const Expression& x) { return op_func<DIV>(*this, x); }
-Expression Expression::operator&(const Expression& x) { return op_func<AND>(*this, x); }
-Expression Expression::operator|(const Expression& x) { return op_func<OR>(*this, x); }
-Expression Expression::operator^(const Expression& x) { return op_func<XOR>(*this, x); }
+Expression Expression::operator+(const Expression& x) const { return op_func<ADD>(*this, x); }
+Expression Expression::operator-(const Expression& x) const { return op_func<SUB>(*this, x); }
+Expression Expression::operator*(const Expression& x) const { return op_func<MUL>(*this, x); }
+Expression Expression::operator/(const Expression& x) const { return op_func<DIV>(*this, x); }
+Expression Expression::operator&(const Expression& x) const { return op_func<AND>(*this, x); }
+Expression Expression::operator|(const Expression& x) const { return op_func<OR>(*this, x); }
+Expression Expression::operator^(const Expression& x) const { return op_func<XOR>(*this, x); }
+
+const std::string& Expression::print() const { return nodes.print(id); }
 
-Expression Expression::operator=(const Symbol& x) 
+void SymbolicEnv::add(const std::string& name, const Expression& e) { env[name] = e; }
+void SymbolicEnv::remove(const std::string& name) { env.erase(name); }
+Expression& SymbolicEnv::operator[](const std::string& name) 
 { 
-	Expression expr(*this);
-	expr.symbols.push_back(x); 
-	return expr;
+	auto found = env.find(name);
+	if (found != env.end()) return found->second;
+	return env.emplace(name, Expression(name)).first->second;
+}
+
+// an address is a base expression plus a constant offset
+static std::pair<uint32_t, int128_t> base_offset(uint32_t address)
+{
+	const Node& node = nodes[address];
+	if (node.type == Node::NUMERIC) return std::make_pair(UINT32_MAX, node.value);
+	if (node.type == Node::EXPRESSION && node.op == ADD && nodes[node.right].type == Node::NUMERIC)
+		return std::make_pair(node.left, nodes[node.right].value);
+	return std::make_pair(address, int128_t(0));
+}
+
+const int MAX_WIDTH = 16;
+
+void SymbolicEnv::insert(uint64_t key, const Cell& cell)
+{
+	cells[key] = cell;
+	placed.emplace(cell.base, cell.offset, key);
+	groups[cell.width][cell.base].insert(key);
+	if (cell.stored) unread[cell.width][cell.base].insert(key);
+}
+
+void SymbolicEnv::erase(uint64_t key)
+{
+	read(key);
+	const Cell& cell = cells.at(key);
+	placed.erase(std::make_tuple(cell.base, cell.offset, key));
+	auto group = groups[cell.width].find(cell.base);
+	group->second.erase(key);
+	if (group->second.empty()) groups[cell.width].erase(group);
+	cells.erase(key);
+	++versions[key];
 }
 
-std::string Expression::print()
+void SymbolicEnv::read(uint64_t key)
 {
-	if (symbols.size() == 1) return symbols[0].print();
-	if (symbols.size() == 2) return std::string("(") + symbols[0].print() + op_strings[op] + symbols[1].print() + ")";
-	return "";
+	Cell& cell = cells.at(key);
+	if (!cell.stored) return;
+	cell.stored = 0;
+	auto group = unread[cell.width].find(cell.base);
+	group->second.erase(key);
+	if (group->second.empty()) unread[cell.width].erase(group);
 }
 
-Symbol::Symbol() : type(UNDEFINED) {}
-Symbol::Symbol(const std::string& x) : type(STRING), name(x) {}
-Symbol::Symbol(int128_t x) : type(NUMERIC), value(x) {}
-Symbol::Symbol(const Expression& x) : type(EXPRESSION), expr(x) {}
-bool Symbol::is_numeric() const
+// the cells from the same base as an access whose bytes overlap it
+std::vector<uint64_t> SymbolicEnv::overlapping(uint32_t base, const int128_t& offset, int width) const
 {
-	if (type == NUMERIC) return true;
-	else if (type == EXPRESSION) return expr.is_numeric();
-	else return false;
+	std::vector<uint64_t> result;
+	auto end = placed.lower_bound(std::make_tuple(base, offset + width, uint64_t(0)));
+	for (auto x = placed.lower_bound(std::make_tuple(base, offset - MAX_WIDTH + 1, uint64_t(0))); x != end; ++x)
+		if (std::get<1>(*x) + cells.at(std::get<2>(*x)).width > offset) result.push_back(std::get<2>(*x));
+	return result;
 }
-std::string Symbol::print()
+
+// a cell which wasn't stored to holds its initial value, named after its address; once the cell may have
+// been written, a new name is used so its old and new values don't compare equal
+Expression SymbolicEnv::load(const Expression& address, int width, size_t line)
 {
-	if (type == NUMERIC) 
+	const uint64_t key = (uint64_t(width) << 32) | address.id;
+	const auto place = base_offset(address.id);
+	report.loads++;
+	// a load reads the stores to the cells it may overlap: from the same base if their bytes overlap, from
+	// other bases if they have the same width (the VM's 32 bit registers are never read as stack or heap cells)
+	Groups& others = unread[width];
+	for (auto group = others.begin(); group != others.end(); )
 	{
-		std::stringstream stream;
-		if (value > 0xFFFFFF) stream << "0x" << std::hex;
-		stream << value;
-		return stream.str();
+		if (group->first == place.first) ++group;
+		else
+		{
+			for (auto x : group->second) cells.at(x).stored = 0;
+			group = others.erase(group);
+		}
 	}
-	else if (type == STRING) return name;
-	else if (type == EXPRESSION) return expr.print();
+	for (auto x : overlapping(place.first, place.second, width)) read(x);
+	auto found = cells.find(key);
+	if (found != cells.end())
+	{
+		report.redundant_loads++;
+		report.note(line, "load of *" + address.print() + " = " + found->second.value.print() + " is redundant");
+		return found->second.value;
+	}
+	std::string name = "*" + address.print();
+	if (uint32_t version = versions[key]) name += "#" + std::to_string(version);
+	Expression value(name);
+	insert(key, Cell{address.id, width, value, 0, place.first, place.second});
+	available.insert(value.id);
+	return value;
 }
 
-void SymbolicEnv::add(const std::string& name, const Symbol& s) { env[name] = s; }
-void SymbolicEnv::remove(const std::string& name) { env.erase(name); }
-Symbol& SymbolicEnv::operator[](const std::string& name) 
-{ 
-	if (env.count(name)) return env[name];
-	env[name] = Symbol(name);
-	return env[name]; 
+void SymbolicEnv::store(const Expression& address, int width, const Expression& value, size_t line)
+{
+	const uint64_t key = (uint64_t(width) << 32) | address.id;
+	report.stores++;
+	auto found = cells.find(key);
+	if (found != cells.end() && found->second.value == value)
+	{
+		report.redundant_stores++;
+		report.note(line, "store of " + value.print() + " to *" + address.print() + " is redundant, the cell holds it");
+		return;
+	}
+	if (found != cells.end() && found->second.stored)
+	{
+		report.dead_stores++;
+		report.note(found->second.stored, "store to *" + address.print() + " is dead, line " + std::to_string(line) + " overwrites it");
+	}
+	// and makes every other cell it may overlap unknown
+	const auto place = base_offset(address.id);
+	std::vector<uint64_t> overlapped = overlapping(place.first, place.second, width);
+	for (auto& group : groups[width])
+		if (group.first != place.first) overlapped.insert(overlapped.end(), group.second.begin(), group.second.end());
+	for (auto x : overlapped) erase(x);
+	insert(key, Cell{address.id, width, value, line, place.first, place.second});
+}
+
+Expression SymbolicEnv::compute(const Expression& e, const std::vector<Expression>& operands, size_t line)
+{
+	report.operations++;
+	Expression result(e);
+	result = result.eval();
+	if (result.is_numeric() || std::find(operands.begin(), operands.end(), result) != operands.end())
+	{
+		report.folded++;
+		report.note(line, "operation folds to " + result.print());
+	}
+	else if (available.count(result.id))
+	{
+		report.recomputations++;
+		report.note(line, "operation recomputes " + result.print());
+	}
+	available.insert(result.id);
+	return result;
+}
+
+Expression SymbolicEnv::fresh(const std::string& name) { return Expression(name + "#" + std::to_string(++fresh_count)); }
+
+void SymbolicEnv::clobber()
+{
+	for (auto& cell : cells) ++versions[cell.first];
+	cells.clear();
+	placed.clear();
+	groups.clear();
+	unread.clear();
+}
+
+void SymbolicEnv::leave()
+{
+	for (auto& cell : cells) cell.second.stored = 0;
+	unread.clear();
+}
+
+void SymbolicEnv::join()
+{
+	clobber();
+	versions.clear();
+	available.clear();
+	env.clear();
 }
+
 void SymbolicEnv::print()
 {
-	for (auto x : env)
-		if (x.first[0] == '*' || x.first == "SP")
-			cout << x.first << " = " << Expression(x.second).print() << endl;
+	for (auto& x : cells)
+		cout << "*" << nodes.print(x.second.address) << " = " << x.second.value.print() << endl;
+	if (env.count("SP")) cout << "SP = " << env["SP"].print() << endl;
+	for (auto x : nodes.references)
+		cout << "@" << x << " = " << nodes.definition(x) << endl;
+}
+
+static std::string percent(size_t part, size_t total)
+{
+	std::stringstream stream;
+	stream.precision(3);
+	stream << (total ? 100.0 * part / total : 0.0) << "%";
+	return stream.str();
+}
+
+void Report::print(bool verbose)
+{
+	if (verbose)
+		for (auto& x : findings) cout << x << endl;
+	cout << "Loads: " << loads << ", " << redundant_loads << " redundant (" << percent(redundant_loads, loads) << ")" << endl;
+	cout << "Stores: " << stores << ", " << redundant_stores << " redundant, " << dead_stores << " dead ("
+		<< percent(redundant_stores + dead_stores, stores) << ")" << endl;
+	cout << "Operations: " << operations << ", " << recomputations << " recomputed, " << folded << " folded ("
+		<< percent(recomputations + folded, operations) << ")" << endl;
 }
 
 std::vector<std::string> split(const std::string& str)
@@ -112,17 +444,51 @@ std::vector<std::string> split(const std::string& str)
 	return result;
 }
 
-
+// a decimal or hexadecimal constant, possibly negative
 bool is_numeric(const std::string& s)
 {
-	if (s[0] == '-' || s[0] == '+') return true;
+	size_t start = s[0] == '-' || s[0] == '+' ? 1 : 0;
+	if (start == s.size()) return false;
 	char* p;
-	long converted = strtoull(s.c_str(), &p, 10);
+	strtoull(s.c_str() + start, &p, 0);
 	return *p ? false : true;
 }
 
-int main()
+int128_t to_number(const std::string& s)
+{
+	if (s[0] == '-') return -int128_t(std::stoull(s.substr(1), nullptr, 0));
+	return int128_t(std::stoull(s[0] == '+' ? s.substr(1) : s, nullptr, 0));
+}
+
+bool starts_with(const std::string& s, const std::string& prefix) { return s.compare(0, prefix.size(), prefix) == 0; }
+
+// the width in bytes of the type a libjit opcode name ends with, e.g. load_relative_uint
+int type_width(const std::string& name)
+{
+	const std::string type = name.substr(name.rfind('_') + 1);
+	if (type == "sbyte" || type == "ubyte") return 1;
+	if (type == "short" || type == "ushort") return 2;
+	if (type == "int" || type == "uint" || type == "float32") return 4;
+	return 8;
+}
+
+// name(a, b, c) as name and its arguments
+bool parse_call(const std::string& text, std::string& name, std::vector<std::string>& args)
 {
+	const size_t open = text.find('('), close = text.rfind(')');
+	if (open == std::string::npos || close == std::string::npos || close < open) return false;
+	name = text.substr(0, open);
+	std::string inside = text.substr(open + 1, close - open - 1);
+	std::replace(inside.begin(), inside.end(), ',', ' ');
+	args = split(inside);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	// -v lists every redundant load, store and operation with its line
+	bool verbose = argc > 1 && std::string(argv[1]) == "-v";
+
 	std::string line;
     std::vector<std::string> input;
     while (std::getline(std::cin, line))
@@ -130,37 +496,112 @@ int main()
 
 	SymbolicEnv env;
 
+	// registers and memory cells hold node ids, so every line takes time independent of the trace length;
+	// lines are either the simple form (x = y op z, *x = y, x = *y) or the IL libjit dumps to temp.il
+	size_t number = 0;
 	for (auto& line : input)
 	{
+		++number;
 		auto tokens = split(line);
-		if (tokens[0][0] == '*')
-			tokens[0] = std::string("*") + env[tokens[0].substr(1, std::string::npos)].print();
-		Symbol& target = env[tokens[0]];
+		if (tokens.empty()) continue;
+		auto operand = [&](const std::string& x) -> Expression
+		{
+			if (is_numeric(x)) return Expression(to_number(x));
+			if (x[0] == '*') return env.load(env[x.substr(1)], 8, number);
+			return env[x];
+		};
+		// .L1:
+		if (tokens.size() == 1 && tokens[0].back() == ':')
+		{
+			env.join();
+			continue;
+		}
+		// if i1 == 0 then goto .L1, goto .L1, return, jump_table(...)
+		if (tokens[0] == "if" || tokens[0] == "goto" || starts_with(tokens[0], "return") || starts_with(tokens[0], "jump_table")
+			|| starts_with(tokens[0], "branch"))
+		{
+			env.leave();
+			continue;
+		}
+		std::string name;
+		std::vector<std::string> args;
+		const size_t assign = line.find(" = ");
+		const std::string rhs = assign == std::string::npos ? line : line.substr(assign + 3);
+		const bool is_call = parse_call(rhs, name, args);
+		if (is_call && starts_with(name, "call")) env.clobber();
+		// store_relative_long(i1, i2, 8)
+		if (assign == std::string::npos)
+		{
+			if (is_call && starts_with(name, "store_relative_") && args.size() == 3)
+			{
+				const Expression address = (operand(args[0]) + operand(args[2])).eval();
+				env.store(address, type_width(name), operand(args[1]), number);
+			}
+			else if (!is_call) cerr << "Can't handle expression: " << line << endl;
+			continue;
+		}
+		Expression value;
+		auto rhs_tokens = split(rhs);
+		// i1 = load_relative_long(i2, 8)
+		if (is_call && starts_with(name, "load_relative_") && args.size() == 2)
+			value = env.load((operand(args[0]) + operand(args[1])).eval(), type_width(name), number);
+		// copies and widening conversions keep the value
+		else if (is_call && (starts_with(name, "copy_") || starts_with(name, "expand_")) && args.size() == 1)
+			value = operand(args[0]);
+		else if (is_call && (starts_with(name, "call") || name.find("_reg") != std::string::npos))
+			value = env.fresh(name);
+		// any other operation, e.g. a conversion, is equal for equal operands
+		else if (is_call)
+		{
+			std::string text = name + "(";
+			std::vector<Expression> operands;
+			for (auto& x : args)
+			{
+				operands.push_back(operand(x));
+				text += (operands.size() > 1 ? ", " : "") + operands.back().print();
+			}
+			value = env.compute(Expression(text + ")"), operands, number);
+		}
 		// i1 = i2
-		if (tokens.size() == 3)
+		else if (rhs_tokens.size() == 1)
 		{
-			if (is_numeric(tokens[2])) target = Symbol(std::stoull(tokens[2]));
-			else if (tokens[2][0] == '*')
-				target = env[std::string("*") + env[tokens[2].substr(1, std::string::npos)].print()];
-			else target = env[tokens[2]];
+			const std::string& x = rhs_tokens[0];
+			if ((x[0] == '-' || x[0] == '~') && !is_numeric(x))
+			{
+				const Expression y = operand(x.substr(1));
+				value = env.compute(x[0] == '-' ? Expression(int128_t(0)) - y : y ^ Expression(int128_t(-1)), {y}, number);
+			}
+			else value = operand(x);
 		}
 		// i1 = i2 + 2
-		else if (tokens.size() == 5)
+		else if (rhs_tokens.size() == 3)
+		{
+			const Expression op1 = operand(rhs_tokens[0]);
+			const Expression op2 = operand(rhs_tokens[2]);
+			const Op op = Op(std::find(op_strings.begin(), op_strings.end(), rhs_tokens[1]) - op_strings.begin());
+			if (op == NOT || op >= UNDEFINED)
+			{
+				cerr << "Can't handle expression: " << line << endl;
+				continue;
+			}
+			Expression e;
+			e.id = nodes.apply(op, op1.id, op2.id);
+			value = env.compute(e, {op1, op2}, number);
+		}
+		else
 		{
-			Symbol op1 = is_numeric(tokens[2]) ? (tokens[2][0] == '-' ? Symbol(std::stoll(tokens[2])) : Symbol(std::stoull(tokens[2]))) : env[tokens[2]];
-			Symbol op2 = is_numeric(tokens[4]) ? (tokens[4][0] == '-' ? Symbol(std::stoll(tokens[4])) : Symbol(std::stoull(tokens[4]))) : env[tokens[4]];
-			if (tokens[3] == "+") target = Expression(op1) + Expression(op2);
-			if (tokens[3] == "-") target = Expression(op1) - Expression(op2);
-			if (tokens[3] == "*") target = Expression(op1) * Expression(op2);
-			if (tokens[3] == "/") target = Expression(op1) / Expression(op2);
-			if (tokens[3] == "&") target = Expression(op1) & Expression(op2);
-			if (tokens[3] == "|") target = Expression(op1) | Expression(op2);
-			if (tokens[3] == "^") target = Expression(op1) ^ Expression(op2);
+			cerr << "Can't handle expression: " << line << endl;
+			continue;
 		}
-		else cerr << "Can't handle expression: " << line << endl;
+		const std::string target = line.substr(0, assign);
+		const auto target_tokens = split(target);
+		if (target_tokens.size() != 1) cerr << "Can't handle expression: " << line << endl;
+		else if (target_tokens[0][0] == '*') env.store(env[target_tokens[0].substr(1)], 8, value, number);
+		else env[target_tokens[0]] = value;
 	}
 
 	env.print();
+	env.report.print(verbose);
 
 	return 0;
-}
\ No newline at end of file
+}
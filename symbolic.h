@@ -1,63 +1,142 @@
 #include <string>
 #include <vector>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <tuple>
 #include <cstdint>
 #include <boost/multiprecision/cpp_int.hpp>
 
 using namespace boost::multiprecision;
 
-class Symbol;
-enum Op { ADD, SUB, MUL, DIV, AND, OR, XOR, NOT, UNDEFINED };
-std::vector<std::string> op_strings = { "+", "-", "*", "/", "&", "|", "^", "!", "NOP" };
+const size_t PRINT_LIMIT = 256;
+
+enum Op { ADD, SUB, MUL, DIV, AND, OR, XOR, NOT, REM, SHL, SHR, USHR, EQ, NE, LT, LE, GT, GE, UNDEFINED };
+std::vector<std::string> op_strings = { "+", "-", "*", "/", "&", "|", "^", "!", "%", "<<", ">>", ">>>", "==", "!=", "<", "<=", ">", ">=", "NOP" };
+
+// a node of the expression DAG: a number, a name or an operation on two other nodes
+struct Node
+{
+	// a node can be a numeric, a string or an expression
+	enum Type { NUMERIC, STRING, EXPRESSION } type;
+	Op 				op;
+	int128_t 		value;
+	std::string 	name;
+	uint32_t 		left, right;
+};
+
+// nodes are immutable and interned (hash-consed): a node is created once, equal nodes have the same id,
+// so an expression is copied by its id and a trace builds a DAG with one node per distinct value
+class NodeTable
+{
+public:
+	uint32_t number(int128_t);
+	uint32_t name(const std::string&);
+	uint32_t apply(Op, uint32_t, uint32_t);
+	// the simplest equal node: constants folded, identities applied, commutative operands ordered
+	uint32_t simplify(uint32_t id);
+	const Node& operator[](uint32_t id) const { return nodes[id]; }
+	// the text of a node is built once, shared subexpressions reuse it; an expression whose text would be
+	// longer than PRINT_LIMIT prints as @id and is listed in 'references' instead, so text stays linear in size
+	const std::string& print(uint32_t id);
+	// the text of a node with its operands printed
+	std::string definition(uint32_t id) const;
+	std::vector<uint32_t> references;
+private:
+	std::vector<Node> nodes;
+	std::vector<std::string> printed;
+	std::vector<bool> is_printed;
+	std::vector<uint32_t> simplified;
+	std::map<int128_t, uint32_t> numbers;
+	std::unordered_map<std::string, uint32_t> names;
+	std::unordered_map<uint64_t, uint32_t> applied[UNDEFINED];
+	uint32_t add(const Node&);
+	uint32_t combine(Op, uint32_t, uint32_t);
+};
+
+NodeTable nodes;
 
 class Expression
 {
 public:
 	Expression();
-	Expression(const Symbol&);
+	Expression(const std::string&);
+	Expression(int128_t);
 	Expression eval();
 
 	bool is_numeric() const;
+	bool operator==(const Expression& x) const { return id == x.id; }
 
-	std::string print();
-
-	Expression operator+(const Expression&);
-	Expression operator-(const Expression&);
-	Expression operator*(const Expression&);
-	Expression operator/(const Expression&);
-	Expression operator&(const Expression&);
-	Expression operator|(const Expression&);
-	Expression operator^(const Expression&);
+	const std::string& print() const;
 
-	Expression operator=(const Symbol&);
+	Expression operator+(const Expression&) const;
+	Expression operator-(const Expression&) const;
+	Expression operator*(const Expression&) const;
+	Expression operator/(const Expression&) const;
+	Expression operator&(const Expression&) const;
+	Expression operator|(const Expression&) const;
+	Expression operator^(const Expression&) const;
 
-	std::vector<Symbol> symbols;
-	Op op;
+	uint32_t id;
 };
 
-class Symbol
+// work a trace repeats: loads of values already in registers, stores of values a cell already holds or
+// that are overwritten before being read, and operations whose result is already in a register or known
+struct Report
 {
-public:
-	Symbol();
-	Symbol(const Expression&);
-	Symbol(const std::string&);
-	Symbol(int128_t);
-	std::string print();
-	bool is_numeric() const;
-	// a symbol can be a numeric, a string or an expression
-	enum Type { NUMERIC, STRING, EXPRESSION, UNDEFINED } type;
-	int128_t 		value;
-	std::string 	name;
-	Expression 		expr;
+	size_t loads = 0, redundant_loads = 0;
+	size_t stores = 0, redundant_stores = 0, dead_stores = 0;
+	size_t operations = 0, recomputations = 0, folded = 0;
+	std::vector<std::string> findings;
+	void note(size_t line, const std::string& what) { findings.push_back(std::to_string(line) + ": " + what); }
+	void print(bool verbose);
 };
 
+// registers and memory cells known in the current block, a memory cell is keyed by its address expression
+// and the width of the access
 class SymbolicEnv
 {
 public:
-	void add(const std::string&, const Symbol&);
+	void add(const std::string&, const Expression&);
 	void remove(const std::string&);
-	Symbol& operator[](const std::string& name);
+	Expression& operator[](const std::string& name);
+	Expression load(const Expression& address, int width, size_t line);
+	void store(const Expression& address, int width, const Expression& value, size_t line);
+	// simplifies the result of an operation and notes if the operation was needed
+	Expression compute(const Expression& e, const std::vector<Expression>& operands, size_t line);
+	// a value nothing is known about, e.g. the result of a call
+	Expression fresh(const std::string& name);
+	// a call may read and write any memory
+	void clobber();
+	// a branch may read the memory stored so far
+	void leave();
+	// a label joins paths, nothing is known about registers or memory after it
+	void join();
 	void print();
+	Report report;
 private:
-	std::unordered_map<std::string, Symbol> env;
+	struct Cell
+	{
+		uint32_t address;
+		int width;
+		Expression value;
+		size_t stored; // line of a store not read yet, 0 if none
+		uint32_t base;
+		int128_t offset;
+	};
+	typedef std::unordered_map<uint32_t, std::unordered_set<uint64_t>> Groups;
+	std::unordered_map<std::string, Expression> env;
+	std::unordered_map<uint64_t, Cell> cells;
+	// cells ordered by base and offset and grouped by width and base, to find the cells an access may overlap
+	// without looking at the others; 'unread' groups the cells with a store not read yet
+	std::set<std::tuple<uint32_t, int128_t, uint64_t>> placed;
+	std::map<int, Groups> groups, unread;
+	std::unordered_map<uint64_t, uint32_t> versions;
+	std::unordered_set<uint32_t> available;
+	uint32_t fresh_count = 0;
+	void insert(uint64_t key, const Cell&);
+	void erase(uint64_t key);
+	void read(uint64_t key);
+	std::vector<uint64_t> overlapping(uint32_t base, const int128_t& offset, int width) const;
 };
@@ -1,25 +1,104 @@
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <list>
 #include <cstring>
 #include <vector>
 #include <chrono>
 
+#include "bignum.h"
+#include "lc.h"
+
 #if WITH_JIT
-#include <map>
 #include <jit/jit.h>
 #include <jit/jit-dump.h>
 #endif
 
+#include <dlfcn.h>
 #include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using std::cout;
 using std::endl;
 
 const size_t STACK_SIZE  = 1000;
 const size_t MEMORY_SIZE = 100000;
+const size_t MAX_MEMORY_SIZE = 1ull << 32; // cells, heap references are 32 bit cell indices
+// return address of lambdas called from native code (map, filter, accum)
+const int CALLBACK_PC = 0x7FFFFFFF;
+// heap images: a header page, the heap from address 0 and the program text
+const char IMAGE_MAGIC[8] = { 'L', 'C', 'I', 'M', 'A', 'G', 'E', '2' };
+const size_t IMAGE_HEAP_OFFSET = 4096;
+
+// Types 8..15 are heap objects: a reference cell points to a Header cell followed by the object's payload.
+// Each reference type shares its low 3 bits with the inline type it extends, so type predicates (EQT)
+// can't tell them apart, e.g. an Int overflowing into a BigInt is still an integer.
+// Hash extends no inline type, it shares its low bits with InstructionPointer, which user code never sees.
+enum CellType : uint8_t { Nil, Pair, Int, String, Lambda, InstructionPointer, Environment, FramePointer,
+                          Header, Vector = Pair | 8, BigInt = Int | 8, Text = String | 8, Memo = Lambda | 8,
+                          Hash = InstructionPointer | 8 };
+
+const uint64_t TYPE_FAMILY_MASK = 0x7000000000000000ull;
+const int64_t INT_MAX60 = (1ll << 59) - 1;
+const int64_t INT_MIN60 = -(1ll << 59);
+
+// Hash object payload: entry count, used slots of the current table (entries and tombstones), the current table,
+// the table being migrated to it (Nil if there is none) and the migration position in that table.
+// Tables are Vectors of key/value slot pairs with a power of 2 capacity, an empty slot has a Nil key.
+enum HashField { HashCount, HashUsed, HashTable, HashOldTable, HashMigrated, HashFields };
+const uint64_t HASH_TOMBSTONE = 1;      // key of a deleted slot, a Nil cell with data 1
+const uint32_t HASH_MIN_CAPACITY = 8;
+const uint32_t HASH_MIGRATE_STEP = 4;   // old table slots moved to the current one by every hset!/hdel!
 
-enum CellType : uint8_t { Nil, Pair, Int, String, Lambda, InstructionPointer, Environment, FramePointer };
+// Memo object payload: the wrapped lambda, the id of its cache and the cache size, header data holds
+// the lambda's arity. The cache lives in the VM (see MemoCache), it is keyed by the arguments' contents.
+enum MemoField { MemoLambda, MemoCacheId, MemoCapacity, MemoFields };
+const size_t MEMO_CAPACITY = 1024;      // cached results of a (memo f) without a size
+const size_t MEMO_KEY_CELLS = 64;       // arguments with more list cells than this aren't cached
+
+inline bool is_object(uint8_t type) { return type > Header; }
+
+// what the verifier knows about a stack cell: call frames are tracked so RET can be checked
+enum VerifyType : uint8_t { AnyCell, IntCell, ReturnCell, EnvCell, FrameCell };
+const uint32_t VERIFY_MAIN = UINT32_MAX;   // owner of the program's main code, which isn't a lambda
+
+// stack effects of instructions with fixed operands: cells an instruction needs, the ones it pops and the ones
+// it pushes; the rest are handled by VM::verify
+struct StackEffect { uint8_t needs, pops, pushes; VerifyType result; };
+const std::unordered_map<std::string, StackEffect> STACK_EFFECTS = {
+    { "GC", { 0, 0, 0, AnyCell } }, { "PRN", { 1, 1, 0, AnyCell } }, { "PRNL", { 0, 0, 0, AnyCell } },
+    { "PUSHS", { 0, 0, 1, AnyCell } }, { "PUSHSTR", { 0, 0, 1, AnyCell } }, { "PUSHNIL", { 0, 0, 1, AnyCell } },
+    { "SLEN", { 1, 1, 1, IntCell } }, { "SREF", { 2, 2, 1, IntCell } }, { "SUBSTR", { 3, 3, 1, AnyCell } },
+    { "CONCAT", { 2, 2, 1, AnyCell } }, { "SCMP", { 2, 2, 1, IntCell } }, { "SFIND", { 2, 2, 1, IntCell } },
+    { "ADD", { 2, 2, 1, AnyCell } }, { "SUB", { 2, 2, 1, AnyCell } }, { "MUL", { 2, 2, 1, AnyCell } },
+    { "DIV", { 2, 2, 1, AnyCell } }, { "MOD", { 2, 2, 1, AnyCell } }, { "DEF", { 1, 1, 1, AnyCell } },
+    { "MKVEC", { 2, 2, 1, AnyCell } }, { "VREF", { 2, 2, 1, AnyCell } }, { "VSET", { 3, 3, 1, AnyCell } },
+    { "VLEN", { 1, 1, 1, IntCell } }, { "VSUM", { 1, 1, 1, AnyCell } }, { "VADD", { 2, 2, 1, AnyCell } },
+    { "MKHASH", { 0, 0, 1, AnyCell } }, { "HGET", { 2, 2, 1, AnyCell } }, { "HSET", { 3, 3, 1, AnyCell } },
+    { "HDEL", { 2, 2, 1, AnyCell } }, { "HCOUNT", { 1, 1, 1, AnyCell } }, { "LOADENV", { 0, 0, 1, AnyCell } },
+    { "STOREENV", { 1, 1, 0, AnyCell } }, { "CONS", { 2, 2, 1, AnyCell } }, { "PUSHCAR", { 1, 0, 1, AnyCell } },
+    { "PUSHCDR", { 1, 0, 1, AnyCell } }, { "EQ", { 2, 2, 1, IntCell } }, { "LT", { 2, 2, 1, IntCell } },
+    { "ADD.i", { 2, 2, 1, AnyCell } }, { "SUB.i", { 2, 2, 1, AnyCell } }, { "MUL.i", { 2, 2, 1, AnyCell } },
+    { "DIV.i", { 2, 2, 1, AnyCell } }, { "MOD.i", { 2, 2, 1, AnyCell } }, { "EQ.i", { 2, 2, 1, IntCell } },
+    { "LT.i", { 2, 2, 1, IntCell } },
+    { "EQT", { 2, 0, 1, IntCell } }, { "EQSI", { 1, 0, 1, IntCell } }, { "LEN", { 1, 1, 1, AnyCell } },
+    { "NTH", { 2, 2, 1, AnyCell } }, { "APPEND", { 2, 2, 1, AnyCell } }, { "REVERSE", { 1, 1, 1, AnyCell } },
+    { "MAP", { 2, 2, 1, AnyCell } }, { "FILTER", { 2, 2, 1, AnyCell } }, { "PMAP", { 2, 2, 1, AnyCell } },
+    { "ACCUM", { 3, 3, 1, AnyCell } }, { "POP", { 1, 1, 0, AnyCell } }, { "CAR", { 1, 1, 1, AnyCell } },
+    { "CDR", { 1, 1, 1, AnyCell } }, { "NOP", { 0, 0, 0, AnyCell } }
+};
 
 struct VM;
 
@@ -33,19 +112,27 @@ std::string type_to_string(CellType type)
     else if (type == InstructionPointer) return "IP  (Call)";
     else if (type == Environment) return "ENV (Call)";
     else if (type == FramePointer) return "FP  (Call)";
+    else if (type == Header) return "Header";
+    else if (type == Vector) return "Vector";
+    else if (type == BigInt) return "BigInt";
+    else if (type == Text) return "Text";
+    else if (type == Hash) return "Hash";
+    else if (type == Memo) return "Memo";
     return "Unknown";
 }
 
 template<typename T>
 std::string data_to_string(const T& x)
 {
-    if (x.type == Pair) return "Pair";
-    else if (x.type == Int) return std::to_string(x.integer);
+    if (x.type == Pair) return "@" + std::to_string(x.pair_addr);
+    else if (x.type == Int) return std::to_string(x.int_value());
     else if (x.type == String) return std::string(x.string);
     else if (x.type == Lambda) return std::to_string(x.lambda_addr);
     else if (x.type == Environment) return std::to_string(x.integer);
     else if (x.type == InstructionPointer) return std::to_string(x.integer);
     else if (x.type == FramePointer) return std::to_string(x.integer);
+    else if (x.type == Header) return std::to_string(x.obj_size) + " cells";
+    else if (is_object(x.type)) return "@" + std::to_string(x.obj_ref);
     return "Unknown";
 }
 
@@ -64,21 +151,32 @@ struct Cell
                 uint8_t             dummy_string : 8;
             } __attribute__((packed));
             struct {
-                uint32_t            left : 30;
-                uint32_t            right : 30;
+                uint32_t            pair_addr : 32; // pair: the car cell, the cdr is the next one
+                uint32_t            pair_aux : 28;
                 uint32_t            dummy_pair : 4;
             } __attribute__((packed));
             struct {
-                uint32_t            lambda_addr : 32;
-                uint32_t            lambda_env : 28;
+                uint32_t            lambda_env : 32;
+                uint32_t            lambda_addr : 28;
                 uint32_t            dummy_lambda : 4;
             } __attribute__((packed));
+            struct {
+                uint32_t            obj_ref : 32;   // heap object reference: address of the header
+                uint32_t            obj_ref_aux : 28;
+                uint32_t            dummy_obj_ref : 4;
+            } __attribute__((packed));
+            struct {
+                uint32_t            obj_size : 32;  // header: payload size in cells
+                uint32_t            obj_kind : 4;   // header: type of the references to this object
+                uint32_t            obj_aux : 24;   // header: type specific data
+                uint32_t            dummy_header : 4;
+            } __attribute__((packed));
             uint64_t                as64;
         };
     } __attribute__((packed));
     Cell() : as64(0) { }
     Cell(uint64_t x) : as64(x) { }
-    static Cell make_integer(int x) { Cell r; r.type = Int; r.integer = x; return r; }
+    static Cell make_integer(int64_t x) { Cell r; r.type = Int; r.integer = x; return r; }
     static Cell make_nil() { Cell r; r.type = Nil; return r; }
     static Cell make_pc(size_t x) { Cell r; r.type = InstructionPointer; r.integer = x; return r; }
     static Cell make_env(size_t x) { Cell r; r.type = Environment; r.integer = x; return r; }
@@ -99,30 +197,203 @@ struct Cell
         r.lambda_env = env; 
         return r; 
     }
-    static Cell make_pair(uint32_t x, uint32_t y) { Cell r; r.type = Pair; r.left = x; r.right = y; return r; }
+    static Cell make_pair(uint32_t addr) { Cell r; r.type = Pair; r.pair_addr = addr; return r; }
+    static Cell make_object(CellType type, uint32_t addr) { Cell r; r.type = type; r.obj_ref = addr; return r; }
+    static Cell make_header(CellType kind, uint32_t size, uint32_t aux)
+    {
+        Cell r;
+        r.type = Header;
+        r.obj_size = size;
+        r.obj_kind = kind;
+        r.obj_aux = aux;
+        return r;
+    }
+
+    // sign extended value of an Int cell
+    int64_t int_value() const { return int64_t(as64 << 4) >> 4; }
 
     std::string pp() { return type_to_string(static_cast<CellType>(type)) + " : " + data_to_string(*this); }
 }  __attribute__((packed));
 
-void vm_print_cell(const Cell cell)
+// raw objects hold plain data rather than cells, so GC neither traces nor relocates their payload;
+// a Text slice (header data bit 0) holds a reference to the buffer it views, so it is traced
+inline bool is_raw_object(const Cell& header)
+{
+    return header.obj_kind == BigInt || (header.obj_kind == Text && !(header.obj_aux & 1));
+}
+
+// header data bit of the Vectors and Hashes a server's prelude can reach, stores into them panic
+const uint32_t OBJ_SEALED = 1 << 23;
+
+// output is buffered, cout is flushed when the VM prints its state on exit
+void vm_print_cell(std::ostream& out, const Cell cell)
+{
+    if (cell.type == Int) out << cell.int_value();
+    else if (cell.type == String) out << cell.string;
+    else if (cell.type == Nil) out << "Nil" << endl;
+}
+
+// a read only view of an Int or BigInt magnitude, pointing either into the heap or into 'small'
+struct NumberView
+{
+    const uint32_t* limbs;
+    size_t size;
+    bool negative;
+    uint32_t small[2];
+};
+
+const uint8_t GC_MARK_CELL = 1;
+const uint8_t GC_MARK_RAW = 2;                  // payload of a raw object, never relocated
+const uint8_t GC_MARK_PAIR = 4;                 // cdr-first copying: the car cell of a pair, copied with its cdr
+const uint8_t GC_MARK_MOVED = 8;                // cdr-first copying: the cell holds its forwarding address
+const uint8_t GC_MARK_DIRTY = 16;               // evacuation: the cell is in gc_dirty
+const size_t GC_MIN_CELLS_PER_THREAD = 8192;    // GC uses fewer threads on smaller heaps
+const size_t GC_SHARE_THRESHOLD = 64;           // work list length above which marking work is shared
+const size_t GC_SLICE_CHECK = 64;               // cells scanned between clock reads in a slice
+const size_t GC_CLEAR_CHUNK = 65536;            // marks cleared between clock reads after a cycle
+
+// marking work handed from busy GC threads to idle ones
+struct GcMarkQueue
+{
+    std::mutex lock;
+    std::vector<uint32_t> shared;
+    std::atomic<size_t> shared_size;
+    std::atomic<size_t> idle;       // threads waiting for work, marking is done when all are
+    GcMarkQueue() : shared_size(0), idle(0) { }
+};
+
+// elements of a pmap list still to be processed by one worker
+struct PmapQueue
+{
+    std::mutex lock;
+    size_t begin;
+    size_t end;
+};
+
+// a read only view of a String or Text, pointing either into the heap or into 'small'
+struct TextView
+{
+    const char* data;
+    size_t size;
+    char small[8];
+};
+
+struct ImageHeader
+{
+    char magic[8];
+    uint64_t heap_size;     // cells
+    uint64_t env_ptr;
+    uint64_t text_size;     // bytes
+};
+
+// memory for the heap comes straight from mmap, so a heap image can be mapped over it;
+// fresh pages are already zero (Nil cells), so cells aren't constructed and a large heap is only
+// backed by memory where it is used
+template<typename T>
+struct MappedAllocator
+{
+    typedef T value_type;
+    MappedAllocator() { }
+    template<typename U> MappedAllocator(const MappedAllocator<U>&) { }
+    T* allocate(size_t n)
+    {
+        void* p = mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return p == MAP_FAILED ? nullptr : static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t n) { munmap(p, n * sizeof(T)); }
+    template<typename U> void construct(U*) { }
+    template<typename U, typename... Args> void construct(U* p, Args&&... args) { new (p) U(std::forward<Args>(args)...); }
+};
+template<typename T, typename U> bool operator==(const MappedAllocator<T>&, const MappedAllocator<U>&) { return true; }
+template<typename T, typename U> bool operator!=(const MappedAllocator<T>&, const MappedAllocator<U>&) { return false; }
+
+std::vector<std::string> read_program(std::istream& in);
+
+lc::Value::Type value_type(uint8_t type)
 {
-    if (cell.type == Int) cout << cell.integer << std::flush;
-    else if (cell.type == String) cout << cell.string << std::flush;
-    else if (cell.type == Nil) cout << "Nil" << endl;
+    switch (type)
+    {
+        case Nil: return lc::Value::Nil;
+        case Pair: return lc::Value::Pair;
+        case Int: return lc::Value::Int;
+        case String: return lc::Value::String;
+        case Lambda: return lc::Value::Lambda;
+        case Memo: return lc::Value::Lambda;
+        case Vector: return lc::Value::Vector;
+        case BigInt: return lc::Value::BigInt;
+        case Text: return lc::Value::Text;
+        case Hash: return lc::Value::Hash;
+        default: return lc::Value::Other;
+    }
 }
 
+// native functions callable with CALLN, shared by a VM and its pmap workers
+struct NativeRegistry : lc::Natives
+{
+    std::unordered_map<std::string, lc::NativeFunction> functions;
+
+    void define(const std::string& name, lc::NativeFunction function) override { functions[name] = function; }
+
+    // shared objects stay loaded, the functions they defined may be copied anywhere
+    bool load(const std::string& path, std::string& error)
+    {
+        void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!library) { error = dlerror(); return false; }
+        void* symbol = dlsym(library, "lc_register");
+        if (!symbol) { error = path + ": no lc_register"; return false; }
+        reinterpret_cast<void (*)(lc::Natives&)>(symbol)(*this);
+        return true;
+    }
+};
+
+// results of a (memo f): keys are the encoded arguments of a call, the most recently used entry is first.
+// Cached values are heap cells, GC marks them through the Memo object and relocates them; the cache is
+// dropped when its Memo object dies
+struct MemoCache
+{
+    typedef std::list<std::pair<std::string, Cell>> Entries;
+    uint32_t owner;     // address of the Memo object's header
+    size_t capacity;
+    Entries entries;
+    std::unordered_map<std::string, Entries::iterator> index;
+};
+
 void jit_vm_gc(VM* vm);
+void jit_vm_calln(VM* vm, const lc::NativeFunction* function, uint32_t argc);
+void jit_vm_call_memo(VM* vm);
+void jit_vm_print(VM* vm, uint64_t cell);
+void jit_vm_interpret(VM* vm, const char* instruction);
 
 struct VM
 {
     // VM vars
+    const size_t memory_size; // cells, both halves of the heap
     std::vector<Cell> stack;
-    std::vector<Cell> heap;
+    std::vector<Cell, MappedAllocator<Cell>> heap;
+    std::vector<uint8_t, MappedAllocator<uint8_t>> gc_marks;
     uint32_t stack_ptr;
     uint32_t frame_ptr;
     uint32_t heap_ptr;
     uint32_t env_ptr;
     bool stop;
+    bool panicked;
+    const std::vector<std::string>* program;
+    std::ostream* output; // PRN/PRNL, panics and debug() write here
+    size_t pmap_threads;
+    std::vector<std::unique_ptr<VM>> pmap_vms;
+    std::shared_ptr<NativeRegistry> natives;
+    std::unordered_map<uint32_t, MemoCache> memo_caches;
+    uint32_t memo_next_id;
+    // bytecode verification (see verify)
+    bool verify_bytecode;
+    bool verified;                          // the running code passed verify(), step_interpret<false> runs it
+    bool rejected;                          // the last run's code was malformed and didn't run
+    size_t verified_size;                   // instructions at the start of the code known to be verified
+    std::vector<int32_t> lambda_arity;      // argument count of the lambda at each address, -1 if none starts there
+    std::vector<uint8_t> verified_int_top;  // RJZ/RJNZ whose condition is always an Int
+    size_t memo_hits;
+    size_t memo_misses;
+    size_t memo_evictions;
     // stat
     int pc;
     int ticks;
@@ -131,6 +402,34 @@ struct VM
     size_t execution_time;
     uint32_t gc_count;
     uint32_t gc_collected;
+    size_t gc_pause_total;  // us
+    size_t gc_pause_max;    // us
+    size_t gc_threads;
+    size_t gc_budget;       // us, incremental collection when non zero
+    bool gc_cdr_first;      // copy lists' spines contiguously instead of keeping address order
+    size_t gc_slices;
+    size_t gc_slice_max;    // us, longest slice; full collections are only in gc_pause_max
+    size_t gc_over_budget;  // slices which took longer than gc_budget
+    // incremental marking state
+    bool gc_marking;
+    uint32_t gc_scan_ptr;   // cells allocated since the cycle started are black, scanned up to here
+    uint32_t gc_root_ptr;   // stack cells below it have been scanned
+    uint32_t gc_object_ptr; // payload of a large object being scanned, up to gc_object_end
+    uint32_t gc_object_end;
+    bool gc_object_raw;
+    std::vector<uint32_t> gc_gray;
+    // incremental evacuation state (see gc_evacuate_slice)
+    bool gc_evacuating;
+    uint32_t gc_source;     // start of the old half
+    uint32_t gc_mark_end;   // cells allocated since marking ended are live
+    uint32_t gc_copy_ptr;   // old half cells below it have been copied
+    uint32_t gc_copy_to;    // end of the copies in the new half
+    uint32_t gc_relocate_ptr;
+    std::vector<uint32_t> gc_block_to;      // address of the first copy of each block of 64 old cells
+    std::vector<uint64_t> gc_block_live;    // live cells of each block of 64 old cells
+    std::vector<uint32_t> gc_dirty;         // old cells written after they were copied
+    uint32_t gc_clear_ptr;  // marks of the old half still to be cleared after a cycle, up to gc_clear_end
+    uint32_t gc_clear_end;
 #if WITH_JIT
     // jit
     jit_context_t ctx;
@@ -142,40 +441,1252 @@ struct VM
     jit_value_t jit_memory_ptr;
     jit_value_t jit_env_ptr;
     jit_value_t jit_gc_count_ptr;
+    // constants used by the code step_jit generates
+    jit_value_t c8, c4, c2, c1, cm1, cm2, cm3;
+    jit_value_t ctypemask, cfamilymask, cinttype, cdatamask, cmemthreshold;
     std::map<size_t, size_t> jit_jump_map;
+    std::vector<size_t> jit_jump_pcs; // jump table index -> pc, lambdas hold jump table indices in JIT mode
     std::vector<jit_label_t> jit_jump_table;
     uint32_t jit_jump_table_current_index;
 #endif
 
-    VM() :  stack_ptr(0),
-            frame_ptr(0),
-            env_ptr(1),
-            heap_ptr(2), // 0 - nil, 1 - global env, 2 - user data
-            stop(false), 
-            pc(0), 
-            ticks(0), 
-            stack_historic_max_size(0), 
-#if WITH_JIT
-            ctx(nullptr),
-            jit_jump_table_current_index(0),
-#endif
-            gc_count(0),
-            gc_collected(0)
-    { 
-        stack.resize(STACK_SIZE);
-        heap.resize(MEMORY_SIZE);
-        // create default env
-        heap[1] = Cell::make_pair(0, 0);
+    VM(size_t memory_size = MEMORY_SIZE, size_t stack_size = STACK_SIZE) :
+            memory_size(memory_size),
+            output(&cout),
+            pmap_threads(std::max(1u, std::thread::hardware_concurrency())),
+            natives(std::make_shared<NativeRegistry>()),
+            verify_bytecode(true),
+            gc_threads(1),
+            gc_budget(0),
+            gc_cdr_first(false),
+            gc_marking(false),
+            gc_evacuating(false),
+            gc_clear_ptr(0),
+            gc_clear_end(0)
+#if WITH_JIT
+            , ctx(nullptr), main(nullptr)
+#endif
+    { 
+        stack.resize(stack_size);
+        heap.resize(memory_size);
+        gc_marks.resize(memory_size);
+        reset();
+    }
+
+    // returns the VM to its initial state, so one VM can run several programs (see --batch)
+    void reset()
+    {
+        stack_ptr = 0;
+        frame_ptr = 0;
+        env_ptr = 1;
+        heap_ptr = 2; // 0 - nil, 1 - global env, 2 - user data
+        stop = false;
+        panicked = false;
+        program = nullptr;
+        pc = 0;
+        ticks = 0;
+        stack_historic_max_size = 0;
+        jit_time = 0;
+        execution_time = 0;
+        gc_count = 0;
+        gc_collected = 0;
+        gc_pause_total = 0;
+        gc_pause_max = 0;
+        gc_slices = 0;
+        gc_slice_max = 0;
+        gc_over_budget = 0;
+        memo_caches.clear();
+        memo_next_id = 0;
+        memo_hits = 0;
+        memo_misses = 0;
+        memo_evictions = 0;
+        verified = false;
+        rejected = false;
+        verified_size = 0;
+        lambda_arity.clear();
+        verified_int_top.clear();
+        // marks are cleared by every collection, only an unfinished incremental cycle leaves some
+        if (!gc_idle()) std::fill(gc_marks.begin(), gc_marks.end(), 0);
+        gc_marking = false;
+        gc_object_ptr = gc_object_end = 0;
+        gc_gray.clear();
+        gc_evacuating = false;
+        gc_dirty.clear();
+        gc_clear_ptr = gc_clear_end = 0;
+#if WITH_JIT
+        if (ctx) jit_context_destroy(ctx);
+        ctx = nullptr;
+        main = nullptr;
+        jit_jump_map.clear();
+        jit_jump_pcs.clear();
+        jit_jump_table.clear();
+        jit_jump_table_current_index = 0;
+#endif
+        // create default env, an empty list of bindings
+        heap[1] = Cell::make_nil();
+    }
+
+    ~VM()
+    {
+#if WITH_JIT
+        if (ctx) jit_context_destroy(ctx);
+#endif
+    }
+
+    void panic(const std::string& op, const std::string& text)
+    {
+        *output << "PANIC: " << op << ", " << text << endl;
+        stop = true;
+        panicked = true;
+    }
+
+    // allocate 'size' contiguous cells, running GC if the current half of the heap is full
+    // returns 0 if there is no space even after GC
+    uint32_t heap_alloc(size_t size)
+    {
+        if (gc_budget) gc_increment();
+        size_t offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+        if ((heap_ptr - offset) + size > (memory_size >> 1) - 3)
+        {
+            gc();
+            offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+            if ((heap_ptr - offset) + size > (memory_size >> 1) - 3) { panic("ALLOC", "Out of memory"); return 0; }
+        }
+        const uint32_t addr = heap_ptr;
+        heap_ptr += size;
+        return addr;
+    }
+
+    // raw view of heap cells starting at 'addr', used for object payloads
+    template<typename T>
+    T* heap_data(uint32_t addr) { return reinterpret_cast<T*>(heap.data() + addr); }
+
+    // stores into a cell allocated before the current instruction, see gc_store_barrier
+    void heap_store(uint32_t addr, const Cell& x)
+    {
+        heap[addr] = x;
+        gc_store_barrier(addr);
+    }
+
+    bool is_number(const Cell& cell) { return cell.type == Int || cell.type == BigInt; }
+
+    void number_view(const Cell& cell, NumberView& view)
+    {
+        if (cell.type == Int)
+        {
+            const int64_t x = cell.int_value();
+            const uint64_t magnitude = x < 0 ? -uint64_t(x) : uint64_t(x);
+            view.negative = x < 0;
+            view.small[0] = uint32_t(magnitude);
+            view.small[1] = uint32_t(magnitude >> 32);
+            view.limbs = view.small;
+            view.size = bn_normalize(view.small, 2);
+        }
+        else
+        {
+            // header aux: bit 0 - sign, bit 1 - the upper half of the last cell is unused
+            const Cell& header = heap[cell.obj_ref];
+            view.negative = header.obj_aux & 1;
+            view.limbs = heap_data<const uint32_t>(cell.obj_ref + 1);
+            view.size = 2 * header.obj_size - ((header.obj_aux >> 1) & 1);
+        }
+    }
+
+    // make an Int cell if the value fits into 60 bits, otherwise allocate a BigInt (may run GC)
+    Cell make_number(bool negative, const limbs_t& magnitude)
+    {
+        const size_t size = bn_normalize(magnitude.data(), magnitude.size());
+        if (size <= 2)
+        {
+            const uint64_t x = (size > 0 ? magnitude[0] : 0) | (size > 1 ? uint64_t(magnitude[1]) << 32 : 0);
+            if (!negative && x <= uint64_t(INT_MAX60)) return Cell::make_integer(x);
+            if (negative && x <= uint64_t(INT_MAX60) + 1) return Cell::make_integer(-int64_t(x));
+        }
+        const uint32_t cells = (size + 1) / 2;
+        const uint32_t addr = heap_alloc(cells + 1);
+        if (!addr) return Cell::make_nil();
+        heap[addr] = Cell::make_header(BigInt, cells, (negative ? 1 : 0) | ((size & 1) ? 2 : 0));
+        heap[addr + cells].as64 = 0;
+        std::copy(magnitude.begin(), magnitude.begin() + size, heap_data<uint32_t>(addr + 1));
+        return Cell::make_object(BigInt, addr);
+    }
+
+    Cell make_number_literal(const std::string& text)
+    {
+        if (text.size() < 18) return Cell::make_integer(std::stoll(text));
+        limbs_t magnitude;
+        bool negative;
+        bn_from_decimal(text, magnitude, negative);
+        return make_number(negative, magnitude);
+    }
+
+    std::string number_to_string(const Cell& cell)
+    {
+        if (cell.type == Int) return std::to_string(cell.int_value());
+        NumberView x;
+        number_view(cell, x);
+        return (x.negative ? "-" : "") + bn_to_decimal(x.limbs, x.size);
+    }
+
+    int number_compare(const Cell& a, const Cell& b)
+    {
+        if (a.type == Int && b.type == Int)
+            return a.int_value() < b.int_value() ? -1 : (a.int_value() > b.int_value() ? 1 : 0);
+        NumberView x, y;
+        number_view(a, x);
+        number_view(b, y);
+        if (x.negative != y.negative) return x.negative ? -1 : 1;
+        const int c = bn_cmp(x.limbs, x.size, y.limbs, y.size);
+        return x.negative ? -c : c;
+    }
+
+    // y op x on arbitrary precision numbers, the result is normalized back to Int when it fits
+    Cell bignum_arith(const std::string& op, const Cell& yc, const Cell& xc)
+    {
+        NumberView x, y;
+        number_view(xc, x);
+        number_view(yc, y);
+        limbs_t result;
+        bool negative = false;
+        if (op == "ADD" || op == "SUB")
+        {
+            const bool xneg = op == "SUB" ? !x.negative : x.negative;
+            result.resize(std::max(x.size, y.size) + 1);
+            if (xneg == y.negative)
+            {
+                bn_add(y.limbs, y.size, x.limbs, x.size, result.data());
+                negative = y.negative;
+            }
+            else if (bn_cmp(y.limbs, y.size, x.limbs, x.size) >= 0)
+            {
+                bn_sub(y.limbs, y.size, x.limbs, x.size, result.data());
+                negative = y.negative;
+            }
+            else
+            {
+                bn_sub(x.limbs, x.size, y.limbs, y.size, result.data());
+                negative = xneg;
+            }
+        }
+        else if (op == "MUL")
+        {
+            result.resize(x.size + y.size);
+            bn_mul(y.limbs, y.size, x.limbs, x.size, result.data());
+            negative = x.negative != y.negative;
+        }
+        else if (op == "DIV" || op == "MOD")
+        {
+            if (!x.size) { panic(op, "Division by zero"); return Cell::make_nil(); }
+            limbs_t quotient;
+            bn_divmod(y.limbs, y.size, x.limbs, x.size, quotient, result);
+            if (op == "DIV") { result.swap(quotient); negative = x.negative != y.negative; }
+            else negative = y.negative;
+        }
+        if (!bn_normalize(result.data(), result.size())) negative = false;
+        return make_number(negative, result);
+    }
+
+    // y op x for ADD/SUB/MUL/DIV/MOD, results not fitting into 60 bits fall back to BigInt (may run GC)
+    Cell arith(const std::string& op, const Cell& y, const Cell& x)
+    {
+        if (!is_number(x) || !is_number(y)) { panic(op, "Type mismatch"); return Cell::make_nil(); }
+        return number_arith(op, y, x);
+    }
+
+    // arith on operands known to be numbers
+    Cell number_arith(const std::string& op, const Cell& y, const Cell& x)
+    {
+        if (x.type == Int && y.type == Int)
+        {
+            const int64_t a = y.int_value(), b = x.int_value();
+            int64_t r = 0;
+            bool overflow = false;
+            if ((op == "DIV" || op == "MOD") && !b) { panic(op, "Division by zero"); return Cell::make_nil(); }
+            if (op == "ADD") r = a + b;
+            else if (op == "SUB") r = a - b;
+            else if (op == "MUL") overflow = __builtin_mul_overflow(a, b, &r);
+            else if (op == "DIV") r = a / b;
+            else if (op == "MOD") r = a % b;
+            if (!overflow && r >= INT_MIN60 && r <= INT_MAX60) return Cell::make_integer(r);
+        }
+        return bignum_arith(op, y, x);
+    }
+
+    // true if all cells are Int, written branch free so that the compiler vectorizes it (SSE2/AVX2 at -O3)
+    static bool all_int(const uint64_t* cells, size_t size)
+    {
+        uint64_t other = 0;
+        for (size_t i = 0; i < size; ++i)
+            other |= (cells[i] >> 60) ^ Int;
+        return !other;
+    }
+
+    // sum of a vector, Int only vectors are summed in blocks of 16 which can't overflow 64 bits
+    Cell vector_sum(uint32_t stack_index)
+    {
+        const Cell& v = stack[stack_index];
+        const size_t size = heap[v.obj_ref].obj_size;
+        const uint64_t* cells = heap_data<const uint64_t>(v.obj_ref + 1);
+        if (all_int(cells, size))
+        {
+            int64_t total = 0;
+            bool overflow = false;
+            for (size_t i = 0; i < size; i += 16)
+            {
+                const size_t end = std::min(size, i + 16);
+                int64_t block = 0;
+                for (size_t j = i; j < end; ++j)
+                    block += int64_t(cells[j] << 4) >> 4;
+                overflow |= __builtin_add_overflow(total, block, &total);
+            }
+            if (!overflow && total >= INT_MIN60 && total <= INT_MAX60) return Cell::make_integer(total);
+        }
+        // generic path, GC may move the vector so it is looked up on the stack for every element
+        Cell total = Cell::make_integer(0);
+        for (size_t i = 0; i < size && !stop; ++i)
+            total = arith("ADD", total, heap[stack[stack_index].obj_ref + 1 + i]);
+        return total;
+    }
+
+    // v[i] += w[i]
+    void vector_add(uint32_t v_index, uint32_t w_index)
+    {
+        const size_t size = heap[stack[v_index].obj_ref].obj_size;
+        uint64_t* v = heap_data<uint64_t>(stack[v_index].obj_ref + 1);
+        const uint64_t* w = heap_data<const uint64_t>(stack[w_index].obj_ref + 1);
+        if (all_int(v, size) && all_int(w, size))
+        {
+            // Int sums never overflow 64 bits, check they fit into 60 before writing anything
+            uint64_t out_of_range = 0;
+            for (size_t i = 0; i < size; ++i)
+                out_of_range |= uint64_t((int64_t(v[i] << 4) >> 4) + (int64_t(w[i] << 4) >> 4) - INT_MIN60) >> 60;
+            if (!out_of_range)
+            {
+                const uint64_t int_type = Cell::make_integer(0).as64;
+                for (size_t i = 0; i < size; ++i)
+                    v[i] = ((v[i] + w[i]) & 0x0FFFFFFFFFFFFFFFull) | int_type;
+                for (size_t i = 0; i < size; ++i)
+                    gc_store_barrier(stack[v_index].obj_ref + 1 + i);
+                return;
+            }
+        }
+        for (size_t i = 0; i < size && !stop; ++i)
+        {
+            const Cell r = arith("ADD", heap[stack[v_index].obj_ref + 1 + i], heap[stack[w_index].obj_ref + 1 + i]);
+            heap_store(stack[v_index].obj_ref + 1 + i, r);
+        }
+    }
+
+    // pops a lambda and enters it, the return address is pushed along with env and frame pointer;
+    // verified code relies on the lambda taking the 'argc' arguments below it
+    void call(int return_pc, uint32_t argc)
+    {
+        if (stack[stack_ptr - 1].type == Memo)
+        {
+            if (verified && heap[stack[stack_ptr - 1].obj_ref].obj_aux != argc) return panic("CALL", "Wrong number of arguments");
+            call_memo();
+            pc = return_pc;
+            return;
+        }
+        // the lambda's cell and two more hold the frame
+        if (stack_ptr + 2 > stack.size()) return panic("CALL", "Stack overflow");
+        Cell& cell = stack[--stack_ptr];
+        if (cell.type != Lambda) return panic("CALL", "Type mismatch");
+        if (verified && (cell.lambda_addr >= lambda_arity.size() || lambda_arity[cell.lambda_addr] != int32_t(argc)))
+            return panic("CALL", "Wrong number of arguments");
+        const uint32_t oldenv = env_ptr;
+        pc = cell.lambda_addr;
+#if WITH_JIT
+        if (ctx) pc = jit_jump_pcs[cell.lambda_addr];
+#endif
+        if (cell.lambda_env) env_ptr = cell.lambda_env;
+        else return panic("CALL", "Lambda has no bound env");
+        size_t old_frame_ptr = frame_ptr;
+        frame_ptr = stack_ptr - 1; // points to the element before lambda being called
+        stack[stack_ptr++] = Cell::make_pc(return_pc);
+        stack[stack_ptr++] = Cell::make_env(oldenv);
+        stack[stack_ptr++] = Cell::make_fp(old_frame_ptr);
+    }
+
+    // [values...] PUSHLC addr skip name... -> [lambda]: a flat closure, its env holds just the named values
+    // (name, value, binding and next node cells for each, after the env cell) and goes on with the top-level
+    // env, which is 'skip' nodes down the current env, so the closure doesn't keep the rest of its creator's
+    // env alive and lookups don't walk it. The values come from the stack, the creator's arguments don't have
+    // to be in its env
+    void push_closure(const std::vector<std::string>& tokens)
+    {
+        uint32_t addr = std::stoi(tokens[1]);
+#if WITH_JIT
+        if (ctx && jit_jump_map.count(addr)) addr = jit_jump_map[addr];
+#endif
+        const size_t captured = tokens.size() - 3;
+        if (stack_ptr < captured) return panic("PUSHLC", "Not enough elements on the stack");
+        const uint32_t block = captured ? heap_alloc(4 * captured + 1) : 0;
+        if (captured && !block) return;
+        uint32_t top = env_ptr;
+        for (int i = std::stoi(tokens[2]); i > 0; --i)
+        {
+            if (heap[top].type != Pair) return panic("PUSHLC", "Env is too short");
+            top = heap[top].pair_addr + 1;
+        }
+        stack_ptr -= captured;
+        // a node's cdr cell holds the next node, the last one gets the top-level env's first node
+        heap[block] = Cell::make_pair(block + 3);
+        for (size_t i = 0; i < captured; ++i)
+        {
+            const uint32_t cell = block + 1 + 4 * i;
+            heap[cell] = Cell::make_string(tokens[3 + i]);
+            heap[cell + 1] = stack[stack_ptr + i];
+            heap[cell + 2] = Cell::make_pair(cell);
+            heap[cell + 3] = i + 1 < captured ? Cell::make_pair(cell + 6) : heap[top];
+        }
+        stack[stack_ptr++] = Cell::make_lambda(addr, captured ? block : top);
+    }
+
+    // appends the contents of an argument to a memo key, false if it can't be part of one
+    // (lambdas, vectors, hashes and lists longer than 'budget' cells)
+    bool memo_key(const Cell& cell, std::string& key, size_t& budget)
+    {
+        if (cell.type == Nil) key += 'n';
+        else if (cell.type == Int)
+        {
+            const int64_t x = cell.int_value();
+            key += 'i';
+            key.append(reinterpret_cast<const char*>(&x), sizeof(x));
+        }
+        else if (cell.type == BigInt) key += 'b' + number_to_string(cell) + ';';
+        else if (is_text(cell))
+        {
+            TextView view;
+            text_view(cell, view);
+            const uint32_t size = view.size;
+            key += 's';
+            key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            key.append(view.data, view.size);
+        }
+        else if (cell.type == Pair && budget)
+        {
+            budget -= 1;
+            key += 'p';
+            return memo_key(heap[cell.pair_addr], key, budget) && memo_key(heap[cell.pair_addr + 1], key, budget);
+        }
+        else return false;
+        return true;
+    }
+
+    // the cache of a Memo object; a copy made by pmap or kept in an image gets a cache of its own
+    MemoCache& memo_cache(const Cell& memo)
+    {
+        Cell& id = heap[memo.obj_ref + 1 + MemoCacheId];
+        const auto cache = memo_caches.find(id.int_value());
+        if (cache != memo_caches.end() && cache->second.owner == memo.obj_ref) return cache->second;
+        id = Cell::make_integer(memo_next_id);
+        gc_store_barrier(memo.obj_ref + 1 + MemoCacheId);
+        MemoCache& created = memo_caches[memo_next_id++];
+        created.owner = memo.obj_ref;
+        created.capacity = heap[memo.obj_ref + 1 + MemoCapacity].int_value();
+        return created;
+    }
+
+    // [args..., memo] -> [result]: returns the cached result of a call with the same arguments, or calls
+    // the wrapped lambda (interpreting it until it returns, like call_lambda) and caches its result
+    void call_memo()
+    {
+        const Cell memo = stack[stack_ptr - 1];
+        const size_t argc = heap[memo.obj_ref].obj_aux;
+        if (stack_ptr < argc + 1) return panic("CALL", "Not enough elements on the stack");
+        MemoCache& cache = memo_cache(memo);
+        const uint32_t id = heap[memo.obj_ref + 1 + MemoCacheId].int_value();
+        std::string key;
+        size_t budget = MEMO_KEY_CELLS;
+        bool cached = true;
+        for (size_t i = argc; i > 0 && cached; --i)
+            cached = memo_key(stack[stack_ptr - 1 - i], key, budget);
+        if (cached)
+        {
+            const auto entry = cache.index.find(key);
+            if (entry != cache.index.end())
+            {
+                memo_hits += 1;
+                cache.entries.splice(cache.entries.begin(), cache.entries, entry->second);
+                stack_ptr -= argc + 1;
+                stack[stack_ptr++] = entry->second->second;
+                return;
+            }
+        }
+        memo_misses += 1;
+        stack[stack_ptr - 1] = heap[memo.obj_ref + 1 + MemoLambda];
+        call_lambda(argc);
+        // the call may have run GC, which drops the caches of dead Memo objects
+        const auto found = memo_caches.find(id);
+        if (stop || !cached || found == memo_caches.end()) return;
+        MemoCache& current = found->second;
+        if (current.index.count(key)) return;
+        if (current.entries.size() >= current.capacity)
+        {
+            current.index.erase(current.entries.back().first);
+            current.entries.pop_back();
+            memo_evictions += 1;
+        }
+        current.entries.emplace_front(key, stack[stack_ptr - 1]);
+        current.index[key] = current.entries.begin();
+        // the Memo object may already be black
+        gc_write_barrier(stack[stack_ptr - 1]);
+    }
+
+    // calls the lambda on top of the stack from native code, interpreting it until it returns;
+    // the result replaces the lambda's 'argc' arguments on the stack
+    void call_lambda(uint32_t argc)
+    {
+        const int old_pc = pc;
+        call(CALLBACK_PC, argc);
+        while (!stop && pc != CALLBACK_PC && pc < program->size())
+            step((*program)[pc]);
+        pc = old_pc;
+    }
+
+    // list builtins follow the prelude (everything.lsp) definitions, including
+    // the way first/rest treat atoms: (first a) is a, (rest a) is Nil
+    bool is_atom(const Cell& cell) { return (cell.type & 7) != Pair; }
+    Cell list_first(const Cell& cell) { return is_atom(cell) ? cell : heap[cell.pair_addr]; }
+    Cell list_rest(const Cell& cell) { return is_atom(cell) ? Cell::make_nil() : heap[cell.pair_addr + 1]; }
+
+    // the elements are walked with first/rest until Nil, a Vector is not a list
+    bool list_check(const std::string& op, Cell l)
+    {
+        for (; l.type != Nil && !is_atom(l); l = heap[l.pair_addr + 1])
+            if (l.type != Pair) { panic(op, "Type mismatch"); return false; }
+        return true;
+    }
+
+    size_t list_count(Cell l)
+    {
+        size_t count = 0;
+        for (; l.type != Nil; l = list_rest(l)) count += 1;
+        return count;
+    }
+
+    Cell list_length(const Cell& l)
+    {
+        if (!list_check("LEN", l)) return Cell::make_nil();
+        return Cell::make_integer(list_count(l));
+    }
+
+    Cell list_nth(int64_t n, Cell l)
+    {
+        if (!list_check("NTH", l)) return Cell::make_nil();
+        for (int64_t i = 0; i != n; ++i)
+        {
+            if (is_atom(l)) return Cell::make_nil();
+            l = list_rest(l);
+        }
+        return list_first(l);
+    }
+
+    // allocates the spine of an n element list in one block, element i's car is at the returned address + 2 * i
+    // and the last cdr is set to 'tail'; returns 0 when n is 0 or the heap is exhausted
+    uint32_t list_alloc(size_t n, uint32_t tail_stack_index)
+    {
+        if (!n) return 0;
+        const uint32_t addr = heap_alloc(2 * n);
+        if (!addr) return 0;
+        for (size_t i = 0; i + 1 < n; ++i)
+            heap[addr + 2 * i + 1] = Cell::make_pair(addr + 2 * i + 2);
+        heap[addr + 2 * n - 1] = stack[tail_stack_index];
+        return addr;
+    }
+
+    // [x, y] -> [(append x y)]
+    void stack_append()
+    {
+        if (!list_check("APPEND", stack[stack_ptr - 2])) return;
+        const size_t n = list_count(stack[stack_ptr - 2]);
+        const uint32_t addr = list_alloc(n, stack_ptr - 1);
+        stack_ptr -= 1;
+        if (!n) stack[stack_ptr - 1] = stack[stack_ptr];
+        if (!n || !addr) return;
+        // GC may have run in list_alloc, so x is read from the stack afterwards
+        Cell x = stack[stack_ptr - 1];
+        for (size_t i = 0; i < n; ++i, x = list_rest(x))
+            heap[addr + 2 * i] = list_first(x);
+        stack[stack_ptr - 1] = Cell::make_pair(addr);
+    }
+
+    // [l] -> [(reverse l)]
+    void stack_reverse()
+    {
+        if (!list_check("REVERSE", stack[stack_ptr - 1])) return;
+        const size_t n = list_count(stack[stack_ptr - 1]);
+        stack[stack_ptr++] = Cell::make_nil();
+        const uint32_t addr = list_alloc(n, stack_ptr - 1);
+        stack_ptr -= 1;
+        if (!n || !addr) return;
+        Cell l = stack[stack_ptr - 1];
+        for (size_t i = 0; i < n; ++i, l = list_rest(l))
+            heap[addr + 2 * (n - 1 - i)] = list_first(l);
+        stack[stack_ptr - 1] = Cell::make_pair(addr);
+    }
+
+    // [f, l] -> [(map f l)] or [(filter f l)]
+    // results are consed onto a reversed list kept on the stack, so GC sees them, and then
+    // appended right to left, which splices list results like the prelude versions do
+    void stack_map(bool filter)
+    {
+        const std::string op = filter ? "FILTER" : "MAP";
+        const uint32_t base = stack_ptr - 2;
+        if (!list_check(op, stack[base + 1])) return;
+        stack[stack_ptr++] = Cell::make_nil(); // reversed results
+        while (stack[base + 1].type != Nil)
+        {
+            if (stack_ptr + 3 > stack.size()) return panic(op, "Stack overflow");
+            stack[stack_ptr++] = list_first(stack[base + 1]);
+            if (filter)
+            {
+                const Cell element = stack[stack_ptr - 1];
+                stack[stack_ptr++] = element;
+            }
+            stack[stack_ptr++] = stack[base];
+            call_lambda(1);
+            if (stop) return;
+            if (filter)
+            {
+                const Cell keep = stack[--stack_ptr];
+                if (keep.type != Int) return panic(op, "Type mismatch");
+                if (!keep.integer) stack_ptr -= 1;
+            }
+            if (stack_ptr == base + 4) stack_cons();
+            stack[base + 1] = list_rest(stack[base + 1]);
+        }
+        stack_map_fold(base);
+    }
+
+    // [f, l, reversed results] -> [(map f l)]
+    void stack_map_fold(uint32_t base)
+    {
+        if (stack_ptr + 3 > stack.size()) return panic("MAP", "Stack overflow");
+        stack[stack_ptr++] = Cell::make_nil(); // result
+        while (stack[base + 2].type != Nil)
+        {
+            stack[stack_ptr++] = heap[stack[base + 2].pair_addr];
+            stack[stack_ptr++] = stack[base + 3];
+            stack_append();
+            stack[base + 3] = stack[--stack_ptr];
+            stack[base + 2] = heap[stack[base + 2].pair_addr + 1];
+        }
+        stack[base] = stack[base + 3];
+        stack_ptr = base + 1;
+    }
+
+    // [f, l] -> [(pmap f l)], the same list as (map f l) computed on worker VMs, one per thread.
+    // Workers run on copies of f and the elements in their own heaps, element outputs are printed in list order.
+    void stack_pmap()
+    {
+        const uint32_t base = stack_ptr - 2;
+        if (!list_check("PMAP", stack[base + 1])) return;
+        const size_t n = list_count(stack[base + 1]);
+        const size_t threads = std::min<size_t>(pmap_threads, n);
+#if WITH_JIT
+        // JIT lambdas hold jump table indices, which workers can't interpret
+        if (ctx) return stack_map(false);
+#endif
+        if (threads < 2) return stack_map(false);
+        std::vector<Cell> elements;
+        for (Cell l = stack[base + 1]; l.type != Nil; l = list_rest(l))
+            elements.push_back(list_first(l));
+        // every worker starts with an equal share of the elements
+        std::vector<PmapQueue> queues(threads);
+        for (size_t t = 0; t < threads; ++t)
+        {
+            queues[t].begin = n * t / threads;
+            queues[t].end = n * (t + 1) / threads;
+        }
+        while (pmap_vms.size() < threads) pmap_vms.emplace_back(new VM(memory_size, stack.size()));
+        for (auto& worker : pmap_vms) worker->natives = natives;
+        std::vector<std::string> outputs(n);
+        std::vector<char> failed(n);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t)
+            workers.emplace_back([&, t]() { pmap_vms[t]->pmap_worker(*this, t, queues, elements, outputs, failed); });
+        for (auto& worker : workers) worker.join();
+        for (size_t t = 0; t < threads; ++t)
+        {
+            ticks += pmap_vms[t]->ticks;
+            memo_hits += pmap_vms[t]->memo_hits;
+            memo_misses += pmap_vms[t]->memo_misses;
+            memo_evictions += pmap_vms[t]->memo_evictions;
+        }
+        // a panic stops at the same point map would, the element output already has the panic message
+        for (size_t i = 0; i < n; ++i)
+        {
+            *output << outputs[i];
+            if (failed[i])
+            {
+                stop = panicked = true;
+                return;
+            }
+        }
+
+        // copy the (index . result) lists back and put the results into a reversed list for stack_map_fold
+        if (stack_ptr + threads + 1 > stack.size()) return panic("PMAP", "Stack overflow");
+        for (size_t t = 0; t < threads && !stop; ++t)
+        {
+            const Cell results = import_cell(*pmap_vms[t], pmap_vms[t]->stack[1]);
+            stack[stack_ptr++] = results;
+        }
+        stack[stack_ptr++] = Cell::make_nil();
+        const uint32_t addr = list_alloc(n, stack_ptr - 1);
+        if (stop) return;
+        for (size_t t = 0; t < threads; ++t)
+            for (Cell l = stack[base + 2 + t]; l.type != Nil; l = heap[l.pair_addr + 1])
+            {
+                const Cell& entry = heap[l.pair_addr];
+                heap[addr + 2 * (n - 1 - heap[entry.pair_addr].int_value())] = heap[entry.pair_addr + 1];
+            }
+        stack[base + 2] = Cell::make_pair(addr);
+        stack_ptr = base + 3;
+        stack_map_fold(base);
+    }
+
+    // a worker takes elements from the front of its own queue, then steals from the back of the others'
+    static bool pmap_take(std::vector<PmapQueue>& queues, size_t self, size_t& index)
+    {
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            PmapQueue& queue = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            if (queue.begin == queue.end) continue;
+            index = k ? --queue.end : queue.begin++;
+            return true;
+        }
+        return false;
+    }
+
+    // runs on a worker thread: calls the parent's pmap lambda on the elements it takes, the stack holds
+    // the lambda and a list of (index . result) pairs, which the parent copies back when all workers are done
+    void pmap_worker(const VM& parent, size_t self, std::vector<PmapQueue>& queues,
+                     const std::vector<Cell>& elements, std::vector<std::string>& outputs, std::vector<char>& failed)
+    {
+        reset();
+        program = parent.program;
+        pmap_threads = 1;
+        const Cell f = import_cell(parent, parent.stack[parent.stack_ptr - 2]);
+        stack[stack_ptr++] = f;
+        stack[stack_ptr++] = Cell::make_nil();
+        size_t i;
+        while (!stop && pmap_take(queues, self, i))
+        {
+            std::ostringstream element_output;
+            output = &element_output;
+            const Cell element = import_cell(parent, elements[i]);
+            stack[stack_ptr++] = element;
+            stack[stack_ptr++] = stack[0];
+            call_lambda(1);
+            if (!stop)
+            {
+                stack[stack_ptr++] = Cell::make_integer(i);
+                stack_cons();
+                stack_cons();
+            }
+            outputs[i] = element_output.str();
+            failed[i] = stop;
+        }
+        output = &cout;
+    }
+
+    // copies everything reachable from 'root' in another VM's heap into one block of this heap, keeping
+    // shared structure and cycles; 'source' is only read, so several VMs can import from it at once
+    Cell import_cell(const VM& source, const Cell& root)
+    {
+        std::unordered_map<uint32_t, uint32_t> moved; // source address -> offset in the block
+        std::vector<std::pair<uint32_t, uint32_t>> order; // source address, cells
+        uint32_t size = 0;
+        // a pair's two cells are moved together, so its cdr stays next to its car
+        auto visit = [&](uint32_t addr, uint32_t cells)
+        {
+            if (moved.count(addr)) return;
+            // plain cells are never Headers, a Header is always the start of an object
+            if (source.heap[addr].type == Header) cells = source.heap[addr].obj_size + 1;
+            moved[addr] = size;
+            order.emplace_back(addr, cells);
+            size += cells;
+        };
+        auto scan = [&](const Cell& c)
+        {
+            if (c.type == Pair) visit(c.pair_addr, 2);
+            else if (c.type == Lambda && c.lambda_env) visit(c.lambda_env, 1);
+            else if (c.type == Environment && c.integer) visit(c.integer, 1);
+            else if (is_object(c.type)) visit(c.obj_ref, 1);
+        };
+        scan(root);
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            const Cell& c = source.heap[order[k].first];
+            if (c.type != Header)
+                for (size_t j = 0; j < order[k].second; ++j) scan(source.heap[order[k].first + j]);
+            else if (!is_raw_object(c))
+                for (size_t j = 1; j <= c.obj_size; ++j) scan(source.heap[order[k].first + j]);
+        }
+        const uint32_t block = size ? heap_alloc(size) : 0;
+        if (size && !block) return Cell::make_nil();
+        auto address = [&](uint32_t addr) -> uint32_t { return moved.count(addr) ? block + moved[addr] : 0; };
+        auto relocate = [&](Cell c)
+        {
+            if (c.type == Pair) c.pair_addr = address(c.pair_addr);
+            else if (c.type == Lambda) c.lambda_env = address(c.lambda_env);
+            else if (c.type == Environment) c.integer = address(c.integer);
+            else if (is_object(c.type)) c.obj_ref = address(c.obj_ref);
+            return c;
+        };
+        for (const auto& span : order)
+        {
+            const Cell& c = source.heap[span.first];
+            Cell* to = &heap[block + moved[span.first]];
+            if (c.type != Header)
+                for (size_t j = 0; j < span.second; ++j) to[j] = relocate(source.heap[span.first + j]);
+            else
+            {
+                to[0] = c;
+                for (size_t j = 1; j <= c.obj_size; ++j)
+                    to[j] = is_raw_object(c) ? source.heap[span.first + j] : relocate(source.heap[span.first + j]);
+            }
+        }
+        return relocate(root);
+    }
+
+    // [op, start, l] -> [(accum op start l)], a right fold using car/cdr
+    void stack_accum()
+    {
+        const uint32_t base = stack_ptr - 3;
+        for (Cell l = stack[base + 2]; l.type != Nil; l = heap[l.pair_addr + 1])
+            if (l.type != Pair) return panic("ACCUM", "Type mismatch");
+        stack_reverse();
+        while (!stop && stack[base + 2].type != Nil)
+        {
+            if (stack_ptr + 3 > stack.size()) return panic("ACCUM", "Stack overflow");
+            stack[stack_ptr++] = heap[stack[base + 2].pair_addr];
+            stack[stack_ptr++] = stack[base + 1];
+            stack[stack_ptr++] = stack[base];
+            call_lambda(2);
+            if (stop) return;
+            stack[base + 1] = stack[--stack_ptr];
+            stack[base + 2] = heap[stack[base + 2].pair_addr + 1];
+        }
+        stack[base] = stack[base + 1];
+        stack_ptr = base + 1;
+    }
+
+    // [cdr, car] -> [pair], may run GC
+    void stack_cons()
+    {
+        const uint32_t addr = heap_alloc(2);
+        if (!addr) return;
+        heap[addr] = stack[--stack_ptr];
+        heap[addr + 1] = stack[--stack_ptr];
+        stack[stack_ptr++] = Cell::make_pair(addr);
+    }
+
+    bool is_text(const Cell& cell) { return cell.type == String || cell.type == Text; }
+
+    void text_view(const Cell& cell, TextView& view)
+    {
+        if (cell.type == String)
+        {
+            std::memcpy(view.small, cell.string, sizeof(cell.string));
+            view.small[sizeof(cell.string)] = 0;
+            view.data = view.small;
+            view.size = std::strlen(view.small);
+        }
+        else
+        {
+            // header aux: bit 0 - slice, bits 1..23 - length in bytes
+            // a slice's payload is a reference to the buffer it views, with the byte offset in its aux bits
+            const Cell& header = heap[cell.obj_ref];
+            view.size = header.obj_aux >> 1;
+            if (header.obj_aux & 1)
+            {
+                const Cell& buffer = heap[cell.obj_ref + 1];
+                view.data = heap_data<const char>(buffer.obj_ref + 1) + buffer.obj_ref_aux;
+            }
+            else view.data = heap_data<const char>(cell.obj_ref + 1);
+        }
+    }
+
+    // allocate an uninitialized Text buffer of 'size' bytes (may run GC), returns 0 if there is no space
+    uint32_t text_alloc(size_t size)
+    {
+        if (size >= (1u << 23)) { panic("ALLOC", "String too long"); return 0; }
+        const uint32_t cells = (size + sizeof(Cell) - 1) / sizeof(Cell);
+        const uint32_t addr = heap_alloc(cells + 1);
+        if (!addr) return 0;
+        heap[addr] = Cell::make_header(Text, cells, size << 1);
+        return addr;
+    }
+
+    // short strings stay inline, longer ones are copied to the heap; 'data' must not point into the heap
+    Cell make_text(const char* data, size_t size)
+    {
+        if (size < sizeof(Cell().string) && !std::memchr(data, 0, size)) return Cell::make_string(std::string(data, size));
+        const uint32_t addr = text_alloc(size);
+        if (!addr) return Cell::make_nil();
+        std::copy(data, data + size, heap_data<char>(addr + 1));
+        return Cell::make_object(Text, addr);
+    }
+
+    int text_compare(const Cell& a, const Cell& b)
+    {
+        TextView x, y;
+        text_view(a, x);
+        text_view(b, y);
+        const int c = std::memcmp(x.data, y.data, std::min(x.size, y.size));
+        if (c) return c < 0 ? -1 : 1;
+        return x.size < y.size ? -1 : (x.size > y.size ? 1 : 0);
+    }
+
+    // [s, start, length] -> [(substr s start length)]
+    // long substrings are slices sharing the buffer of s, short ones are copied inline
+    void stack_substr()
+    {
+        const Cell start = stack[stack_ptr - 2], length = stack[stack_ptr - 1];
+        if (!is_text(stack[stack_ptr - 3]) || start.type != Int || length.type != Int) return panic("SUBSTR", "Type mismatch");
+        TextView s;
+        text_view(stack[stack_ptr - 3], s);
+        const int64_t i = start.int_value(), n = length.int_value();
+        if (i < 0 || n < 0 || i + n > int64_t(s.size)) return panic("SUBSTR", "Index out of range");
+        stack_ptr -= 2;
+        Cell r;
+        if (n < int64_t(sizeof(s.small)))
+        {
+            char small[sizeof(s.small)];
+            std::memcpy(small, s.data + i, n);
+            r = make_text(small, n);
+        }
+        else
+        {
+            const uint32_t addr = heap_alloc(2);
+            if (!addr) return;
+            // GC may have moved s, slices of slices view the underlying buffer directly
+            const Cell& parent = stack[stack_ptr - 1];
+            Cell buffer = Cell::make_object(Text, parent.obj_ref);
+            if (heap[parent.obj_ref].obj_aux & 1) buffer = heap[parent.obj_ref + 1];
+            buffer.obj_ref_aux += i;
+            heap[addr] = Cell::make_header(Text, 1, (n << 1) | 1);
+            heap[addr + 1] = buffer;
+            r = Cell::make_object(Text, addr);
+        }
+        stack[stack_ptr - 1] = r;
+    }
+
+    // [x, y] -> [(concat x y)]
+    void stack_concat()
+    {
+        if (!is_text(stack[stack_ptr - 2]) || !is_text(stack[stack_ptr - 1])) return panic("CONCAT", "Type mismatch");
+        TextView x, y;
+        text_view(stack[stack_ptr - 2], x);
+        text_view(stack[stack_ptr - 1], y);
+        const size_t size = x.size + y.size;
+        Cell r;
+        if (size < sizeof(x.small))
+        {
+            char small[sizeof(x.small)];
+            std::memcpy(small, x.data, x.size);
+            std::memcpy(small + x.size, y.data, y.size);
+            r = make_text(small, size);
+        }
+        else
+        {
+            const uint32_t addr = text_alloc(size);
+            if (!addr) return;
+            // GC may have moved the operands
+            text_view(stack[stack_ptr - 2], x);
+            text_view(stack[stack_ptr - 1], y);
+            char* data = heap_data<char>(addr + 1);
+            std::copy(x.data, x.data + x.size, data);
+            std::copy(y.data, y.data + y.size, data + x.size);
+            r = Cell::make_object(Text, addr);
+        }
+        stack[--stack_ptr - 1] = r;
+    }
+
+    // a CALLN call: the arguments are the top 'argc' stack cells and the result goes into the cell above them,
+    // so everything the native function sees or returns is a GC root
+    struct NativeFrame : lc::NativeCall
+    {
+        VM& vm;
+        const uint32_t base;
+        const size_t argc;
+
+        NativeFrame(VM& vm, uint32_t base, size_t argc) : vm(vm), base(base), argc(argc) { }
+        const Cell& arg(size_t i) const { return vm.stack[base + i]; }
+        Cell& result() { return vm.stack[base + argc]; }
+
+        size_t count() const override { return argc; }
+        lc::Value::Type type(size_t i) const override { return i < argc ? value_type(arg(i).type) : lc::Value::Nil; }
+        int64_t integer(size_t i) const override { return i < argc && arg(i).type == Int ? arg(i).int_value() : 0; }
+        std::string text(size_t i) const override
+        {
+            if (i >= argc) return "";
+            if (arg(i).type == Int || arg(i).type == BigInt) return vm.number_to_string(arg(i));
+            if (!vm.is_text(arg(i))) return "";
+            TextView view;
+            vm.text_view(arg(i), view);
+            return std::string(view.data, view.size);
+        }
+        void return_nil() override { result() = Cell::make_nil(); }
+        void return_integer(int64_t x) override
+        {
+            if (x >= INT_MIN60 && x <= INT_MAX60) { result() = Cell::make_integer(x); return; }
+            const uint64_t magnitude = x < 0 ? 0 - uint64_t(x) : uint64_t(x);
+            const Cell r = vm.make_number(x < 0, limbs_t { uint32_t(magnitude), uint32_t(magnitude >> 32) });
+            result() = r;
+        }
+        void return_text(const std::string& text) override
+        {
+            const Cell r = vm.make_text(text.data(), text.size());
+            result() = r;
+        }
+        void return_argument(size_t i) override { result() = i < argc ? arg(i) : Cell::make_nil(); }
+        void fail(const std::string& message) override { vm.panic("CALLN", message); }
+    };
+
+    // [args...] -> [(name args...)]
+    void call_native(const std::string& name, size_t argc)
+    {
+        const auto function = natives->functions.find(name);
+        if (function == natives->functions.end()) return panic("CALLN", "Unknown native function " + name);
+        call_native(function->second, argc);
+    }
+
+    void call_native(const lc::NativeFunction& function, size_t argc)
+    {
+        if (stack_ptr < argc) return panic("CALLN", "Not enough elements on the stack");
+        if (stack_ptr >= stack.size()) return panic("CALLN", "Stack overflow");
+        const uint32_t base = stack_ptr - argc;
+        stack[stack_ptr++] = Cell::make_nil();
+        NativeFrame frame(*this, base, argc);
+        function(frame);
+        stack[base] = stack[base + argc];
+        stack_ptr = base + 1;
+    }
+
+    // PUSHSTR operand: the string literal with \\, \s (space), \n and \t escaped
+    Cell make_text_literal(const std::string& text)
+    {
+        std::string s;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] != '\\' || i + 1 == text.size()) { s.push_back(text[i]); continue; }
+            const char c = text[++i];
+            s.push_back(c == 's' ? ' ' : (c == 'n' ? '\n' : (c == 't' ? '\t' : c)));
+        }
+        return make_text(s.data(), s.size());
+    }
+
+    // hash tables use open addressing with linear probing; growing allocates the new table at once,
+    // but entries are moved from the old one a few slots at a time by the following writes
+    Cell& hash_field(const Cell& h, HashField field) { return heap[h.obj_ref + 1 + field]; }
+
+    void hash_field_set(const Cell& h, HashField field, const Cell& x) { heap_store(h.obj_ref + 1 + field, x); }
+
+    void hash_field_add(const Cell& h, HashField field, int64_t x)
+    {
+        hash_field_set(h, field, Cell::make_integer(hash_field(h, field).int_value() + x));
+    }
+
+    bool is_sealed(const Cell& object) { return heap[object.obj_ref].obj_aux & OBJ_SEALED; }
+
+    bool is_hash_key(const Cell& key) { return key.type == Int || is_text(key); }
+
+    uint64_t hash_key(const Cell& key)
+    {
+        if (key.type == Int)
+        {
+            uint64_t x = key.as64;
+            x ^= x >> 33;
+            x *= 0xFF51AFD7ED558CCDull;
+            return x ^ (x >> 33);
+        }
+        // FNV-1a of the bytes, inline and heap strings with the same text hash the same
+        TextView s;
+        text_view(key, s);
+        uint64_t x = 14695981039346656037ull;
+        for (size_t i = 0; i < s.size; ++i)
+            x = (x ^ uint8_t(s.data[i])) * 1099511628211ull;
+        return x;
+    }
+
+    bool hash_key_equal(const Cell& slot_key, const Cell& key)
+    {
+        if (key.type == Int) return slot_key.as64 == key.as64;
+        return is_text(slot_key) && text_compare(slot_key, key) == 0;
+    }
+
+    // slot of 'key' in the table at 'table' or -1, 'free_slot' receives the first slot 'key' can be inserted into
+    int64_t hash_probe(uint32_t table, const Cell& key, uint64_t hash, int64_t* free_slot)
+    {
+        const uint32_t mask = heap[table].obj_size / 2 - 1;
+        int64_t first_free = -1;
+        for (uint32_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n)
+        {
+            const Cell& k = heap[table + 1 + 2 * i];
+            if (k.as64 == HASH_TOMBSTONE || !k.as64)
+            {
+                if (first_free < 0) first_free = i;
+                if (!k.as64) break;
+            }
+            else if (hash_key_equal(k, key)) return i;
+        }
+        if (free_slot) *free_slot = first_free;
+        return -1;
+    }
+
+    uint32_t hash_table_alloc(uint32_t capacity)
+    {
+        const uint32_t addr = heap_alloc(2 * capacity + 1);
+        if (!addr) return 0;
+        heap[addr] = Cell::make_header(Vector, 2 * capacity, 0);
+        std::fill(&heap[addr + 1], &heap[addr + 1] + 2 * capacity, Cell::make_nil());
+        return addr;
+    }
+
+    Cell hash_get(const Cell& h, const Cell& key)
+    {
+        const uint64_t hash = hash_key(key);
+        for (HashField field : { HashTable, HashOldTable })
+        {
+            const Cell table = hash_field(h, field);
+            if (table.type != Vector) continue;
+            const int64_t slot = hash_probe(table.obj_ref, key, hash, nullptr);
+            if (slot >= 0) return heap[table.obj_ref + 2 + 2 * slot];
+        }
+        return Cell::make_nil();
     }
 
-    ~VM()
+    bool hash_remove(const Cell& h, HashField field, const Cell& key, uint64_t hash)
     {
-#if WITH_JIT
-        if (ctx) jit_context_destroy(ctx);
-#endif
+        const Cell table = hash_field(h, field);
+        if (table.type != Vector) return false;
+        const int64_t slot = hash_probe(table.obj_ref, key, hash, nullptr);
+        if (slot < 0) return false;
+        heap_store(table.obj_ref + 1 + 2 * slot, Cell(HASH_TOMBSTONE));
+        heap_store(table.obj_ref + 2 + 2 * slot, Cell::make_nil());
+        hash_field_add(h, HashCount, -1);
+        return true;
+    }
+
+    // moves up to 'steps' slots of the old table into the current one, dropping the old table when it is empty
+    void hash_migrate(const Cell& h, uint32_t steps)
+    {
+        const Cell old = hash_field(h, HashOldTable);
+        if (old.type != Vector) return;
+        const uint32_t table = hash_field(h, HashTable).obj_ref;
+        const uint32_t capacity = heap[old.obj_ref].obj_size / 2;
+        uint32_t i = hash_field(h, HashMigrated).int_value();
+        for (; i < capacity && steps; ++i, --steps)
+        {
+            const Cell key = heap[old.obj_ref + 1 + 2 * i];
+            if (key.as64 == HASH_TOMBSTONE || !key.as64) continue;
+            int64_t slot = -1;
+            // a key is never in both tables and the current one has room for every entry (see hash_grow),
+            // migration stops at an entry breaking either, so it is still found in the old table
+            if (hash_probe(table, key, hash_key(key), &slot) >= 0 || slot < 0) break;
+            heap_store(table + 1 + 2 * slot, key);
+            heap_store(table + 2 + 2 * slot, heap[old.obj_ref + 2 + 2 * i]);
+            heap_store(old.obj_ref + 1 + 2 * i, Cell(HASH_TOMBSTONE));
+            hash_field_add(h, HashUsed, 1);
+        }
+        hash_field_set(h, HashMigrated, Cell::make_integer(i));
+        if (i == capacity) hash_field_set(h, HashOldTable, Cell::make_nil());
+    }
+
+    // replaces the current table with an empty one, twice as large unless most used slots are tombstones,
+    // and starts migrating entries to it; may run GC
+    bool hash_grow(uint32_t h_index)
+    {
+        // a previous migration still running is finished first, normally it is done long before
+        hash_migrate(stack[h_index], UINT32_MAX);
+        const Cell& h = stack[h_index];
+        const uint32_t capacity = heap[hash_field(h, HashTable).obj_ref].obj_size / 2;
+        const bool grow = 2 * hash_field(h, HashCount).int_value() >= capacity;
+        const uint32_t addr = hash_table_alloc(grow ? 2 * capacity : capacity);
+        if (!addr) return false;
+        // GC may have moved the hash table
+        const Cell& moved = stack[h_index];
+        hash_field_set(moved, HashOldTable, hash_field(moved, HashTable));
+        hash_field_set(moved, HashTable, Cell::make_object(Vector, addr));
+        hash_field_set(moved, HashMigrated, Cell::make_integer(0));
+        hash_field_set(moved, HashUsed, Cell::make_integer(0));
+        return true;
+    }
+
+    // [h, key, value] -> [h]
+    void stack_hash_set()
+    {
+        const uint32_t h_index = stack_ptr - 3;
+        if (stack[h_index].type != Hash || !is_hash_key(stack[h_index + 1])) return panic("HSET", "Type mismatch");
+        if (is_sealed(stack[h_index])) return panic("HSET", "Object is read only");
+        hash_migrate(stack[h_index], HASH_MIGRATE_STEP);
+        const uint64_t hash = hash_key(stack[h_index + 1]);
+        // a key is never in both tables, the old table only shrinks
+        hash_remove(stack[h_index], HashOldTable, stack[h_index + 1], hash);
+        int64_t free_slot;
+        Cell table = hash_field(stack[h_index], HashTable);
+        int64_t slot = hash_probe(table.obj_ref, stack[h_index + 1], hash, &free_slot);
+        if (slot < 0)
+        {
+            const Cell& h = stack[h_index];
+            const int64_t capacity = heap[table.obj_ref].obj_size / 2;
+            // keep the load factor at most 3/4 counting tombstones
+            if (4 * (hash_field(h, HashUsed).int_value() + 1) > 3 * capacity)
+            {
+                if (!hash_grow(h_index)) return;
+                table = hash_field(stack[h_index], HashTable);
+                hash_probe(table.obj_ref, stack[h_index + 1], hash, &free_slot);
+            }
+            slot = free_slot;
+            if (!heap[table.obj_ref + 1 + 2 * slot].as64) hash_field_add(stack[h_index], HashUsed, 1);
+            hash_field_add(stack[h_index], HashCount, 1);
+            heap_store(table.obj_ref + 1 + 2 * slot, stack[h_index + 1]);
+        }
+        heap_store(table.obj_ref + 2 + 2 * slot, stack[h_index + 2]);
+        stack_ptr -= 2;
+    }
+
+    // [h, key] -> [h]
+    void stack_hash_del()
+    {
+        const uint32_t h_index = stack_ptr - 2;
+        if (stack[h_index].type != Hash || !is_hash_key(stack[h_index + 1])) return panic("HDEL", "Type mismatch");
+        if (is_sealed(stack[h_index])) return panic("HDEL", "Object is read only");
+        hash_migrate(stack[h_index], HASH_MIGRATE_STEP);
+        const uint64_t hash = hash_key(stack[h_index + 1]);
+        if (!hash_remove(stack[h_index], HashTable, stack[h_index + 1], hash))
+            hash_remove(stack[h_index], HashOldTable, stack[h_index + 1], hash);
+        stack_ptr -= 1;
+    }
+
+    void print_cell(const Cell& cell)
+    {
+        if (cell.type == BigInt) *output << number_to_string(cell);
+        else if (cell.type == Text)
+        {
+            TextView view;
+            text_view(cell, view);
+            output->write(view.data, view.size);
+        }
+        else vm_print_cell(*output, cell);
     }
 
-    void panic(const std::string& op, const std::string& text) { cout << "PANIC: " << op << ", " << text << endl; stop = true; }
+    std::string pp(const Cell& cell)
+    {
+        if (cell.type == BigInt) return type_to_string(BigInt) + " : " + number_to_string(cell);
+        if (cell.type == Text)
+        {
+            TextView view;
+            text_view(cell, view);
+            return type_to_string(Text) + " : " + std::string(view.data, std::min<size_t>(view.size, 60));
+        }
+        return Cell(cell).pp();
+    }
 
     std::vector<std::string> tokenize(const std::string x)
     {
@@ -186,10 +1697,236 @@ struct VM
         return strings;
     }
 
-    void run(const std::vector<std::string>& program)
+    // abstract state of the stack before an instruction, positions are relative to the stack pointer when
+    // the main code started or, in a lambda, to the first cell above its arguments (its return address)
+    struct VerifyState
     {
-        pc = 0;
+        bool seen;
+        uint32_t owner;             // entry of the lambda the instruction belongs to, or VERIFY_MAIN
+        int low;                    // position of types[0]; in a lambda, arguments below it are AnyCells
+        std::vector<uint8_t> types; // VerifyType of the cells from 'low' to the top of the stack
+        int top() const { return low + int(types.size()); }
+    };
+
+    // checks the code which runs from 'start' and the lambdas defined by it by abstract interpretation:
+    // the stack depth before every instruction must be the same on all paths reaching it, instructions
+    // mustn't take more cells than the main code pushed or than a lambda's frame and arguments hold, and
+    // RET must find the call frame on top of the stack. A lambda's argument count follows from its RET,
+    // and CALL n must find n arguments, which call() checks when verified code runs.
+    // Returns false with a diagnostic in 'error' if the code is malformed, and false with an empty 'error'
+    // if its depths can't be known (CALL without an argument count, or a lambda which never returns).
+    bool verify(const std::vector<std::string>& program, size_t start, std::string& error)
+    {
+        // code before 'start' is kept between runs, it is checked again unless it was verified already
+        const size_t from = start <= verified_size ? start : 0;
+        const size_t size = program.size();
+        std::vector<VerifyState> states(size - from + 1);
+        std::map<uint32_t, int> arity, lowest;
+        std::vector<uint32_t> work;
+        std::vector<std::vector<std::string>> code(size - from);
+        auto fail = [&](size_t at, const std::string& text)
+        {
+            error = "pc " + std::to_string(at) + " (" + (at < size ? program[at] : std::string("end of code")) + "): " + text;
+            return false;
+        };
+        auto number = [](const std::string& token, long& value)
+        {
+            char* end = nullptr;
+            value = strtol(token.c_str(), &end, 10);
+            return !token.empty() && !*end;
+        };
+        // lambda entries start with their call frame on the stack
+        for (size_t i = from; i < size; ++i)
+        {
+            code[i - from] = tokenize(program[i]);
+            const auto& tokens = code[i - from];
+            if (tokens.empty()) return fail(i, "empty instruction");
+            if (tokens[0] != "PUSHL" && tokens[0] != "PUSHLC") continue;
+            long addr;
+            if (tokens.size() < (tokens[0] == "PUSHL" ? 2 : 3) || !number(tokens[1], addr)) return fail(i, "bad operand");
+            if (tokens[0] == "PUSHL" && addr == -1) continue;
+            if (addr < long(from) || addr >= long(size)) return fail(i, "lambda address out of range");
+            VerifyState& entry = states[addr - from];
+            if (entry.seen) continue;
+            entry = { true, uint32_t(addr), 0, { ReturnCell, EnvCell, FrameCell } };
+            arity[addr] = -1;
+            lowest[addr] = 0;
+            work.push_back(addr);
+        }
+        if (start < size && states[start - from].seen) return fail(start, "main code starts at a lambda");
+        if (start <= size)
+        {
+            states[start - from] = { true, VERIFY_MAIN, 0, {} };
+            work.push_back(start);
+        }
+        while (!work.empty())
+        {
+            const size_t at = work.back();
+            work.pop_back();
+            VerifyState state = states[at - from];
+            if (at == size)
+            {
+                if (state.owner != VERIFY_MAIN) return fail(at, "lambda runs past the end of the code");
+                continue;
+            }
+            const auto& tokens = code[at - from];
+            const std::string& op = tokens[0];
+            // makes the cell at 'position' part of 'types', false if the main code would read below the stack
+            auto reach = [&](int position)
+            {
+                if (position >= state.low) return true;
+                if (state.owner == VERIFY_MAIN) return false;
+                state.types.insert(state.types.begin(), state.low - position, AnyCell);
+                state.low = position;
+                lowest[state.owner] = std::min(lowest[state.owner], position);
+                return true;
+            };
+            auto type_at = [&](int position) -> uint8_t& { return state.types[position - state.low]; };
+            long x = 0;
+            std::vector<size_t> next(1, at + 1);
+            const auto effect = STACK_EFFECTS.find(op);
+            if (effect != STACK_EFFECTS.end())
+            {
+                if (!reach(state.top() - effect->second.needs)) return fail(at, "stack underflow");
+                state.types.resize(state.types.size() - effect->second.pops);
+                state.types.resize(state.types.size() + effect->second.pushes, effect->second.result);
+            }
+            else if (op == "PUSHCI")
+            {
+                if (tokens.size() < 2) return fail(at, "missing operand");
+                // long literals may be BigInts
+                state.types.push_back(tokens[1].size() < 18 ? IntCell : AnyCell);
+            }
+            else if (op == "PUSHL" || op == "PUSHLC")
+            {
+                const int captured = op == "PUSHLC" ? tokens.size() - 3 : 0;
+                if (!reach(state.top() - captured)) return fail(at, "stack underflow");
+                state.types.resize(state.types.size() - captured);
+                state.types.push_back(AnyCell);
+            }
+            else if (op == "SWAP" || op == "PUSHFS")
+            {
+                if (tokens.size() < 2 || !number(tokens[1], x) || x < 0) return fail(at, "bad operand");
+                const int position = state.top() - (op == "SWAP" ? 2 : 1) - x;
+                if (!reach(position)) return fail(at, "stack underflow");
+                if (op == "PUSHFS") state.types.push_back(type_at(position));
+                else std::swap(type_at(position), state.types.back());
+            }
+            else if (op == "PUSHFP")
+            {
+                // frame_ptr is the last argument's position
+                if (state.owner == VERIFY_MAIN) return fail(at, "PUSHFP outside a lambda");
+                if (tokens.size() < 2 || !number(tokens[1], x) || x - 1 >= state.top()) return fail(at, "bad operand");
+                reach(x - 1);
+                state.types.push_back(type_at(x - 1));
+            }
+            else if (op == "CALLN" || op == "CALL" || op == "MEMO")
+            {
+                // a lambda call leaves its result in place of the arguments and the lambda
+                const size_t count = op == "CALLN" ? 3 : 2;
+                if (op == "CALL" && tokens.size() < 2)
+                {
+                    error.clear();
+                    return false;
+                }
+                if (tokens.size() < count || !number(tokens[count - 1], x) || x < 0) return fail(at, "bad operand");
+                const int needs = op == "CALLN" ? x : op == "CALL" ? x + 1 : 1;
+                if (!reach(state.top() - needs)) return fail(at, "stack underflow");
+                state.types.resize(state.types.size() - needs);
+                state.types.push_back(AnyCell);
+            }
+            else if (op == "RJMP" || op == "RJZ" || op == "RJNZ")
+            {
+                if (tokens.size() < 2 || !number(tokens[1], x)) return fail(at, "bad operand");
+                if (op != "RJMP" && !reach(state.top() - 1)) return fail(at, "stack underflow");
+                if (long(at) + x < long(from) || long(at) + x > long(size)) return fail(at, "jump target out of range");
+                if (op == "RJMP") next.clear();
+                next.push_back(at + x);
+            }
+            else if (op == "RET")
+            {
+                if (state.owner == VERIFY_MAIN) return fail(at, "RET outside a lambda");
+                if (tokens.size() < 2 || !number(tokens[1], x) || x < 0) return fail(at, "bad operand");
+                const int top = state.top();
+                if (!reach(top - 3) || type_at(top - 1) != FrameCell || type_at(top - 2) != EnvCell || type_at(top - 3) != ReturnCell)
+                    return fail(at, "the call frame isn't on top of the stack");
+                // RET leaves one cell in place of the arguments
+                const int argc = x + 4 - top;
+                if (argc < 0) return fail(at, "returns more cells than the lambda has");
+                if (arity[state.owner] >= 0 && arity[state.owner] != argc)
+                    return fail(at, "returns from " + std::to_string(argc) + " arguments, another RET from " + std::to_string(arity[state.owner]));
+                arity[state.owner] = argc;
+                next.clear();
+            }
+            else if (op == "FIN") next.clear();
+            else return fail(at, "unknown instruction");
+            for (const size_t target : next)
+            {
+                VerifyState& merged = states[target - from];
+                if (!merged.seen) merged = state;
+                else
+                {
+                    if (merged.owner != state.owner) return fail(target, "code shared by two lambdas or a lambda and the main code");
+                    if (merged.top() != state.top())
+                        return fail(target, "stack depth " + std::to_string(state.top()) + " from pc " + std::to_string(at) +
+                                            ", " + std::to_string(merged.top()) + " on another path");
+                    const auto types = merged.types;
+                    if (state.low < merged.low) merged.types.insert(merged.types.begin(), merged.low - state.low, AnyCell);
+                    merged.low = std::min(merged.low, state.low);
+                    for (int i = state.low; i < state.top(); ++i)
+                        if (merged.types[i - merged.low] != state.types[i - state.low]) merged.types[i - merged.low] = AnyCell;
+                    if (merged.types == types) continue;
+                }
+                work.push_back(target);
+            }
+        }
+        for (const auto& lambda : arity)
+        {
+            // a lambda which never returns can't tell how many arguments it has
+            if (lambda.second < 0)
+            {
+                error.clear();
+                return false;
+            }
+            if (lowest[lambda.first] < -lambda.second)
+                return fail(lambda.first, "lambda reads below its arguments (" + std::to_string(lambda.second) + ")");
+        }
+        lambda_arity.resize(size);
+        verified_int_top.resize(size);
+        std::fill(lambda_arity.begin() + from, lambda_arity.end(), -1);
+        for (const auto& lambda : arity) lambda_arity[lambda.first] = lambda.second;
+        for (size_t i = from; i < size; ++i)
+            verified_int_top[i] = states[i - from].seen && !states[i - from].types.empty() && states[i - from].types.back() == IntCell;
+        verified_size = size;
+        return true;
+    }
+
+    void step(const std::string& instruction)
+    {
+        if (verified) step_interpret<false>(instruction);
+        else step_interpret<true>(instruction);
+    }
+
+    void run(const std::vector<std::string>& program, int start_pc = 0)
+    {
+        this->program = &program;
+        pc = start_pc;
         auto start = std::chrono::steady_clock::now();
+        verified = rejected = false;
+#if WITH_JIT
+        if (!ctx)
+#endif
+        if (verify_bytecode)
+        {
+            std::string error;
+            verified = verify(program, start_pc, error);
+            if (!verified) verified_size = std::min<size_t>(verified_size, start_pc);
+            if (!error.empty())
+            {
+                rejected = true;
+                return panic("VERIFY", error);
+            }
+        }
 #if WITH_JIT
         if (ctx) prepare_jump_table(program);
 #endif
@@ -199,7 +1936,7 @@ struct VM
             if(ctx) step_jit(program[pc]);
             else 
 #endif
-                step_interpret(program[pc]);
+                step(program[pc]);
 #if WITH_JIT
             if (!ctx)
 #endif
@@ -218,6 +1955,9 @@ struct VM
                     FILE* out = fopen("temp.il", "w");
                 while (jit_block_t block = jit_block_next(main, previous))
                 {
+                    // a labelled block can be reached by a jump, symbolic forgets what it knows there
+                    jit_label_t label = jit_block_get_label(block);
+                    if (label != jit_label_undefined) fprintf(out, ".L%lu:\n", (unsigned long)label);
                     jit_insn_iter_t it;
                     jit_insn_iter_init(&it, block);
                     while (1)
@@ -251,96 +1991,267 @@ struct VM
         }     
     }
 
+    // streaming mode (see main -s): instructions are appended to 'code' as they are read from 'in',
+    // and the VM only waits for input when it has run everything read so far
+    void run_stream(std::istream& in, std::vector<std::string>& code)
+    {
+        program = &code;
+        pc = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::string line;
+        while (!stop)
+        {
+            while (pc >= code.size() && std::getline(in, line)) code.push_back(line);
+            if (pc >= code.size()) break;
+            step_interpret<true>(code[pc]);
+            stack_historic_max_size = stack.size() > stack_historic_max_size ? stack.size() : stack_historic_max_size;
+        }
+        auto diff = std::chrono::steady_clock::now() - start;
+        execution_time = std::chrono::duration_cast<std::chrono::milliseconds>(diff).count();
+    }
+
+    // 'checked' is false for bytecode which passed verify(): its stack depths are known to be sufficient,
+    // so underflow checks are compiled out
+    template<bool checked>
     void step_interpret(const std::string& instruction)
     {
         bool dont_step_pc = false;
         auto tokens = tokenize(instruction);
         if (tokens.empty()) return;
         const std::string op = tokens[0];
+        // an instruction pushes at most one cell, CALL checks for its frame
+        if (stack_ptr >= stack.size()) return panic(op, "Stack overflow");
 
         // for operations allocating heap space, check if we need to start GC
         if (op == "CONS" || op == "DEF" || op == "STOREENV")
         {
-            const size_t offset = (gc_count & 1) ? (MEMORY_SIZE >> 1) : 0;
-            if ((heap_ptr - offset) > ((MEMORY_SIZE >> 1) - 3)) gc();
+            if (gc_budget) gc_increment();
+            const size_t offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+            if ((heap_ptr - offset) > ((memory_size >> 1) - 3)) gc();
         }
 
         if (op == "GC") gc();
         else if (op == "PRN")
         {
-            if (stack_ptr < 1) return panic(op, "Not enough elements on the stack");
-            vm_print_cell(stack[--stack_ptr]);
+            if (checked && stack_ptr < 1) return panic(op, "Not enough elements on the stack");
+            print_cell(stack[--stack_ptr]);
         }
         else if (op == "PRNL")
-            vm_print_cell(Cell::make_string("\n"));
+            vm_print_cell(*output, Cell::make_string("\n"));
         else if (op == "PUSHCI")
-            stack[stack_ptr++] = Cell::make_integer(std::stoi(tokens[1]));
+        {
+            const Cell x = make_number_literal(tokens[1]);
+            stack[stack_ptr++] = x;
+        }
         else if (op == "PUSHS")
             stack[stack_ptr++] = Cell::make_string(tokens[1].c_str());
+        else if (op == "PUSHSTR")
+        {
+            const Cell x = make_text_literal(tokens.size() > 1 ? tokens[1] : "");
+            stack[stack_ptr++] = x;
+        }
+        else if (op == "SLEN")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            if (!is_text(stack[stack_ptr - 1])) return panic(op, "Type mismatch");
+            TextView s;
+            text_view(stack[stack_ptr - 1], s);
+            stack[stack_ptr - 1] = Cell::make_integer(s.size);
+        }
+        else if (op == "SREF")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            const Cell i = stack[stack_ptr - 1];
+            if (!is_text(stack[stack_ptr - 2]) || i.type != Int) return panic(op, "Type mismatch");
+            TextView s;
+            text_view(stack[stack_ptr - 2], s);
+            if (i.int_value() < 0 || i.int_value() >= int64_t(s.size)) return panic(op, "Index out of range");
+            stack[--stack_ptr - 1] = Cell::make_integer(uint8_t(s.data[i.int_value()]));
+        }
+        else if (op == "SUBSTR")
+        {
+            if (checked && stack_ptr < 3) return panic(op, "Not enough elements on the stack");
+            stack_substr();
+        }
+        else if (op == "CONCAT")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            stack_concat();
+        }
+        else if (op == "SCMP" || op == "SFIND")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            if (!is_text(stack[stack_ptr - 2]) || !is_text(stack[stack_ptr - 1])) return panic(op, "Type mismatch");
+            int64_t r = 0;
+            if (op == "SCMP") r = text_compare(stack[stack_ptr - 2], stack[stack_ptr - 1]);
+            else
+            {
+                // index of the first occurrence of the second string in the first one, -1 if there is none
+                TextView s, x;
+                text_view(stack[stack_ptr - 2], s);
+                text_view(stack[stack_ptr - 1], x);
+                const char* found = std::search(s.data, s.data + s.size, x.data, x.data + x.size);
+                r = found == s.data + s.size && x.size ? -1 : found - s.data;
+            }
+            stack[--stack_ptr - 1] = Cell::make_integer(r);
+        }
         else if (op == "ADD" || op == "SUB" || op == "MUL" || op == "DIV" || op == "MOD")
         {
-            if (stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            Cell x = stack[--stack_ptr];
+            Cell y = stack[--stack_ptr];
+            const Cell result = arith(op, y, x);
+            stack[stack_ptr++] = result;
+        }
+        // unchecked variants, the compiler proved the operands are numbers (see main -t)
+        else if (op == "ADD.i" || op == "SUB.i" || op == "MUL.i" || op == "DIV.i" || op == "MOD.i")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
             Cell x = stack[--stack_ptr];
             Cell y = stack[--stack_ptr];
-            if (x.type != Int || y.type != Int) return panic(op, "Type mismatch");
-            if (op == "ADD") stack[stack_ptr++] = Cell::make_integer(y.integer + x.integer);
-            else if (op == "SUB") stack[stack_ptr++] = Cell::make_integer(y.integer - x.integer);
-            else if (op == "MUL") stack[stack_ptr++] = Cell::make_integer(y.integer * x.integer);
-            else if (op == "DIV") stack[stack_ptr++] = Cell::make_integer(y.integer / x.integer);
-            else if (op == "MOD") stack[stack_ptr++] = Cell::make_integer(y.integer % x.integer);
+            const Cell result = number_arith(op.substr(0, 3), y, x);
+            stack[stack_ptr++] = result;
+        }
+        else if (op == "LT.i" || op == "EQ.i")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            const int c = number_compare(stack[stack_ptr - 2], stack[stack_ptr - 1]);
+            stack_ptr -= 1;
+            stack[stack_ptr - 1] = Cell::make_integer(op == "LT.i" ? c < 0 : c == 0);
         }
         else if (op == "DEF")
         {
-            if (!stack_ptr) return panic(op, "Not enough elements on the stack");
+            if (checked && !stack_ptr) return panic(op, "Not enough elements on the stack");
             Cell xy = stack[stack_ptr - 1];
             heap[heap_ptr++] = xy;
            	heap[heap_ptr++] = heap[env_ptr];
-            heap[env_ptr].right = heap_ptr - 1;
-            heap[env_ptr].left = heap_ptr - 2;
-            stack[stack_ptr - 1] = heap[xy.left];
+            heap_store(env_ptr, Cell::make_pair(heap_ptr - 2));
+            stack[stack_ptr - 1] = heap[xy.pair_addr];
+        }
+        else if (op == "MKVEC")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            const Cell n = stack[stack_ptr - 2];
+            if (n.type != Int || n.int_value() < 0) return panic(op, "Type mismatch");
+            const uint32_t addr = heap_alloc(n.int_value() + 1);
+            if (!addr) return;
+            // read the initial value after allocating, GC may have moved it
+            const Cell x = stack[--stack_ptr];
+            heap[addr] = Cell::make_header(Vector, n.int_value(), 0);
+            std::fill(&heap[addr + 1], &heap[addr + 1] + n.int_value(), x);
+            stack[stack_ptr - 1] = Cell::make_object(Vector, addr);
+        }
+        else if (op == "VREF" || op == "VSET")
+        {
+            const uint32_t args = op == "VSET" ? 3 : 2;
+            if (checked && stack_ptr < args) return panic(op, "Not enough elements on the stack");
+            Cell& v = stack[stack_ptr - args];
+            const Cell i = stack[stack_ptr - args + 1];
+            if (v.type != Vector || i.type != Int) return panic(op, "Type mismatch");
+            if (i.int_value() < 0 || i.int_value() >= heap[v.obj_ref].obj_size) return panic(op, "Index out of range");
+            if (op == "VSET" && is_sealed(v)) return panic(op, "Object is read only");
+            const uint32_t element = v.obj_ref + 1 + i.int_value();
+            // VSET leaves the vector on the stack, VREF replaces it with the element
+            if (op == "VSET") heap_store(element, stack[stack_ptr - 1]);
+            else v = heap[element];
+            stack_ptr -= args - 1;
+        }
+        else if (op == "VLEN" || op == "VSUM")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            if (stack[stack_ptr - 1].type != Vector) return panic(op, "Type mismatch");
+            const Cell r = op == "VLEN" ? Cell::make_integer(heap[stack[stack_ptr - 1].obj_ref].obj_size) : vector_sum(stack_ptr - 1);
+            stack[stack_ptr - 1] = r;
+        }
+        else if (op == "VADD")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            const Cell& v = stack[stack_ptr - 2];
+            const Cell& w = stack[stack_ptr - 1];
+            if (v.type != Vector || w.type != Vector) return panic(op, "Type mismatch");
+            if (heap[v.obj_ref].obj_size != heap[w.obj_ref].obj_size) return panic(op, "Length mismatch");
+            if (is_sealed(v)) return panic(op, "Object is read only");
+            vector_add(stack_ptr - 2, stack_ptr - 1);
+            stack_ptr -= 1;
+        }
+        else if (op == "MKHASH")
+        {
+            // the hash object and its first table are allocated as one block
+            const uint32_t addr = heap_alloc(HashFields + 1 + 2 * HASH_MIN_CAPACITY + 1);
+            if (!addr) return;
+            const uint32_t table = addr + HashFields + 1;
+            heap[addr] = Cell::make_header(Hash, HashFields, 0);
+            heap[table] = Cell::make_header(Vector, 2 * HASH_MIN_CAPACITY, 0);
+            std::fill(&heap[table + 1], &heap[table + 1] + 2 * HASH_MIN_CAPACITY, Cell::make_nil());
+            const Cell h = Cell::make_object(Hash, addr);
+            hash_field(h, HashCount) = Cell::make_integer(0);
+            hash_field(h, HashUsed) = Cell::make_integer(0);
+            hash_field(h, HashTable) = Cell::make_object(Vector, table);
+            hash_field(h, HashOldTable) = Cell::make_nil();
+            hash_field(h, HashMigrated) = Cell::make_integer(0);
+            stack[stack_ptr++] = h;
+        }
+        else if (op == "HGET")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            const Cell h = stack[stack_ptr - 2], key = stack[stack_ptr - 1];
+            if (h.type != Hash || !is_hash_key(key)) return panic(op, "Type mismatch");
+            stack[--stack_ptr - 1] = hash_get(h, key);
+        }
+        else if (op == "HSET")
+        {
+            if (checked && stack_ptr < 3) return panic(op, "Not enough elements on the stack");
+            stack_hash_set();
+        }
+        else if (op == "HDEL")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            stack_hash_del();
+        }
+        else if (op == "HCOUNT")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            if (stack[stack_ptr - 1].type != Hash) return panic(op, "Type mismatch");
+            stack[stack_ptr - 1] = hash_field(stack[stack_ptr - 1], HashCount);
         }
         else if (op == "LOADENV")
             stack[stack_ptr++] = heap[env_ptr];
         else if (op == "STOREENV")
         {
-            if (!stack_ptr) panic(op, "Not enough elements on the stack");
+            if (checked && !stack_ptr) panic(op, "Not enough elements on the stack");
             // migrate env from stack to memory
             heap[heap_ptr++] = stack[--stack_ptr];
             env_ptr = heap_ptr - 1;
         }
         else if (op == "CONS")
         {
-            if (stack_ptr < 2) return panic(op, "Not enought elements on the stack");            
+            if (checked && stack_ptr < 2) return panic(op, "Not enought elements on the stack");            
             // migrate left and right from stack to memory
             const Cell x = stack[--stack_ptr];
             const Cell y = stack[--stack_ptr];
             heap[heap_ptr++] = x; 
             heap[heap_ptr++] = y;
-            stack[stack_ptr++] = Cell::make_pair(heap_ptr - 2, heap_ptr - 1);
+            stack[stack_ptr++] = Cell::make_pair(heap_ptr - 2);
         }
         else if (op == "PUSHCAR" || op == "PUSHCDR")
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
             const Cell& cell = stack[stack_ptr - 1];
             if (cell.type != Pair) return panic(op, "Type mismatch");
-            if (op == "PUSHCAR" && stack[stack_ptr - 1].left)
-                stack[stack_ptr] = heap[stack[stack_ptr - 1].left];
-            else if (op == "PUSHCAR" && stack[stack_ptr - 1].right)
-                stack[stack_ptr] = heap[stack[stack_ptr - 1].right];
-            else stack[stack_ptr] = Cell::make_nil();
+            stack[stack_ptr] = heap[op == "PUSHCAR" ? cell.pair_addr : cell.pair_addr + 1];
             stack_ptr += 1;
         }
         else if (op == "EQ")
         {
-            if (stack_ptr < 2) return panic(op, "Not enought elements on the stack");
+            if (checked && stack_ptr < 2) return panic(op, "Not enought elements on the stack");
             Cell x = stack[stack_ptr - 1];
             Cell y = stack[stack_ptr - 2];
             stack_ptr -= 2;
-            if (x.type != y.type) return panic(op, "Type mismatch");
-            if (x.type == Int)
-                stack[stack_ptr++] = Cell::make_integer(x.integer == y.integer);
-            else if (x.type == String)
-                stack[stack_ptr++] = Cell::make_integer(std::string(x.string) == std::string(y.string));
+            if (is_number(x) && is_number(y))
+                stack[stack_ptr++] = Cell::make_integer(number_compare(x, y) == 0);
+            else if (is_text(x) && is_text(y))
+                stack[stack_ptr++] = Cell::make_integer(text_compare(x, y) == 0);
+            else if (x.type != y.type) return panic(op, "Type mismatch");
             else if (x.type == Nil)
                 stack[stack_ptr++] = Cell::make_integer(1);
             else if (x.type == Lambda)
@@ -349,24 +2260,24 @@ struct VM
         }
         else if (op == "LT")
         {
-            if (stack_ptr < 2) return panic(op, "Not enought elements on the stack");
+            if (checked && stack_ptr < 2) return panic(op, "Not enought elements on the stack");
             Cell x = stack[stack_ptr - 1];
             Cell y = stack[stack_ptr - 2];
             stack_ptr -= 2;
-            if (x.type != y.type) return panic(op, "Type mismatch");
-            if (x.type == Int) stack[stack_ptr++] = Cell::make_integer(y.integer < x.integer);
+            if (is_number(x) && is_number(y)) stack[stack_ptr++] = Cell::make_integer(number_compare(y, x) < 0);
+            else if (is_text(x) && is_text(y)) stack[stack_ptr++] = Cell::make_integer(text_compare(y, x) < 0);
             else return panic(op, "Type mismatch");
         }
         else if (op == "EQT")
         {
-            if (stack_ptr < 2) return panic(op, "Not enought elements on the stack");
+            if (checked && stack_ptr < 2) return panic(op, "Not enought elements on the stack");
             const Cell& x = stack[stack_ptr - 1];
             const Cell& y = stack[stack_ptr - 2];
-            stack[stack_ptr++] = Cell::make_integer(x.type == y.type);
+            stack[stack_ptr++] = Cell::make_integer((x.type & 7) == (y.type & 7));
         }
         else if (op == "EQSI")
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
             const Cell& x = stack[stack_ptr - 1];
             if (x.type != String) return panic(op, "Type mismatch");
             stack[stack_ptr] = Cell::make_integer(tokens[1] == x.string ? 1 : 0);
@@ -374,9 +2285,9 @@ struct VM
         }
         else if (op == "RJNZ" || op == "RJZ")
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
             Cell& cell = stack[stack_ptr - 1];
-            if (cell.type != Int) return panic(op, "Type mismatch");
+            if ((checked || !verified_int_top[pc]) && cell.type != Int) return panic(op, "Type mismatch");
             if ((op == "RJNZ" && cell.integer) ||
                 (op == "RJZ" && !cell.integer))
             {
@@ -397,181 +2308,760 @@ struct VM
             stack_ptr += 1;
         }
         else if (op == "FIN") stop = true;
+        else if (op == "CALLN") call_native(tokens[1], std::stoi(tokens[2]));
         else if (op == "PUSHL")
-            stack[stack_ptr++] = Cell::make_lambda(std::stoi(tokens[1]), env_ptr);
+        {
+            uint32_t addr = std::stoi(tokens[1]);
+#if WITH_JIT
+            // keep lambdas created by callbacks callable from JIT code
+            if (ctx && jit_jump_map.count(addr)) addr = jit_jump_map[addr];
+#endif
+            stack[stack_ptr++] = Cell::make_lambda(addr, env_ptr);
+        }
+        else if (op == "PUSHLC") push_closure(tokens);
+        else if (op == "MEMO")
+        {
+            // wraps the lambda on top of the stack, calls with the same arguments share one result
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            if (stack[stack_ptr - 1].type != Lambda) return panic(op, "Type mismatch");
+            const size_t capacity = tokens.size() > 2 ? std::stoul(tokens[2]) : MEMO_CAPACITY;
+            if (!capacity) return panic(op, "Cache size must be positive");
+            const uint32_t addr = heap_alloc(MemoFields + 1);
+            if (!addr) return;
+            heap[addr] = Cell::make_header(Memo, MemoFields, std::stoi(tokens[1]));
+            heap[addr + 1 + MemoLambda] = stack[stack_ptr - 1];
+            heap[addr + 1 + MemoCacheId] = Cell::make_integer(memo_next_id);
+            heap[addr + 1 + MemoCapacity] = Cell::make_integer(capacity);
+            MemoCache& cache = memo_caches[memo_next_id++];
+            cache.owner = addr;
+            cache.capacity = capacity;
+            stack[stack_ptr - 1] = Cell::make_object(Memo, addr);
+        }
         else if (op == "CALL")
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
-            Cell& cell = stack[--stack_ptr];
-            if (cell.type != Lambda) return panic(op, "Type mismatch");
-            const int old_pc = pc;
-            const uint32_t oldenv = env_ptr;
-            pc = cell.lambda_addr;
-            if (cell.lambda_env) env_ptr = cell.lambda_env;
-            else return panic(op, "Lambda has no bound env");
-            size_t old_frame_ptr = frame_ptr;
-            frame_ptr = stack_ptr - 1; // points to the element before lambda being called
-            stack[stack_ptr++] = Cell::make_pc(old_pc + 1);
-            stack[stack_ptr++] = Cell::make_env(oldenv);
-            stack[stack_ptr++] = Cell::make_fp(old_frame_ptr);
-            dont_step_pc = true;
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            call(pc + 1, tokens.size() > 1 ? std::stoul(tokens[1]) : 0);
+            dont_step_pc = true;
+        }
+        else if (op == "LEN")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            const Cell r = list_length(stack[stack_ptr - 1]);
+            stack[stack_ptr - 1] = r;
+        }
+        else if (op == "NTH")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            if (stack[stack_ptr - 2].type != Int) return panic(op, "Type mismatch");
+            const Cell r = list_nth(stack[stack_ptr - 2].int_value(), stack[stack_ptr - 1]);
+            stack[--stack_ptr - 1] = r;
+        }
+        else if (op == "APPEND")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            stack_append();
+        }
+        else if (op == "REVERSE")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            stack_reverse();
+        }
+        else if (op == "MAP" || op == "FILTER")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            stack_map(op == "FILTER");
+        }
+        else if (op == "PMAP")
+        {
+            if (checked && stack_ptr < 2) return panic(op, "Not enough elements on the stack");
+            stack_pmap();
+        }
+        else if (op == "ACCUM")
+        {
+            if (checked && stack_ptr < 3) return panic(op, "Not enough elements on the stack");
+            stack_accum();
+        }
+        else if (op == "RET")
+        {
+            const size_t stack_ptr_offset = std::stoi(tokens[1]);
+            frame_ptr = stack[--stack_ptr].integer;
+            env_ptr = stack[--stack_ptr].integer;
+            pc = stack[--stack_ptr].integer;
+            stack_ptr -= stack_ptr_offset;
+            dont_step_pc = true;
+        }
+        else if (op == "POP")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            stack_ptr -= 1;
+        }
+        else if (op == "CAR" || op == "CDR")
+        {
+            if (checked && !stack_ptr) return panic(op, "Empty stack");
+            Cell& cell = stack[stack_ptr - 1];
+            if (cell.type != Pair) return panic(op, "Type mismatch");
+            cell = heap[op == "CAR" ? cell.pair_addr : cell.pair_addr + 1];
+        }
+        else if (op == "SWAP")
+        {
+            // TODO: check swap argument and issue panic in case needed
+            const uint32_t elno = stack_ptr - 2 - std::stoi(tokens[1]);
+            if (checked && stack_ptr < 2) return panic(op, "Not enought elements on the stack");
+            Cell tmp = stack[stack_ptr - 1];
+            stack[stack_ptr - 1] = stack[elno];
+            stack[elno] = tmp;
+        }
+        else if (op == "NOP")
+        {
+        }
+        if (!dont_step_pc) pc += 1;
+        ticks += 1;
+    }
+    
+    void debug()
+    {
+#if WITH_JIT
+        if (main)
+        {
+            *output << "Disassembly:" << endl;
+            jit_dump_function(stdout, main, "program");
+        }
+#endif
+        const size_t offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+        *output << "PC: " << pc << endl;
+        *output << "Verified: " << (verified ? "yes" : "no") << endl;
+        *output << "Ticks: " << ticks << endl;
+        *output << "JIT time: " << jit_time << " ms" << endl;
+        *output << "Execution time: " << execution_time<< " ms" << endl;
+        *output << "GC ran: " << gc_count << " time(s)" << endl;
+        *output << "  Collected: " << gc_collected << " cells" << endl;
+        *output << "  Pauses: " << gc_pause_max << " us max, " << gc_pause_total << " us total" << endl;
+        if (gc_budget)
+            *output << "  Incremental: " << gc_slices << " slices, " << gc_slice_max << " us max, " << gc_over_budget << " over " << gc_budget << " us" << endl;
+        if (memo_hits || memo_misses)
+            *output << "Memo: " << memo_hits << " hits, " << memo_misses << " misses, " << memo_evictions << " evictions" << endl;
+        *output << "Environment pointer: " << env_ptr << endl;
+        *output << "Stack size: " << stack_ptr << endl;
+        *output << "Memory size: " << heap_ptr - offset << " of " << (memory_size >> 1) << " cells" << endl;
+        *output << "Stack:" <<  endl;
+        for (int i = stack_ptr - 1; i >= 0; --i)
+            *output << "    " << pp(stack[i]) << endl;
+        // *output << "Memory:" << endl;
+        // for (int i = offset; i < heap_ptr; ++i)
+        //     *output << "    " << heap[i].pp() << endl;
+    }
+
+    // runs f(0) .. f(n - 1) on n threads, f(0) on the calling one
+    template<typename F>
+    static void parallel_for(size_t n, F f)
+    {
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < n; ++t) threads.emplace_back(f, t);
+        f(0);
+        for (auto& thread : threads) thread.join();
+    }
+
+    // reachability is kept in a side bitmap, so every bit of a cell is available for its type and data.
+    // A cell or object is claimed by the marking thread which atomically sets its mark first,
+    // objects are claimed through their header.
+    bool gc_try_mark(uint32_t i)
+    {
+        if (__atomic_load_n(&gc_marks[i], __ATOMIC_RELAXED) || __atomic_exchange_n(&gc_marks[i], GC_MARK_CELL, __ATOMIC_RELAXED))
+            return false;
+        const Cell& header = heap[i];
+        // header and payload are marked together, so scavenging keeps the object contiguous;
+        // raw payloads get their own mark so relocation skips them. Incremental marking marks the
+        // payload of a large object while it scans it (see gc_scan_slice)
+        if (header.type == Header && !(gc_marking && header.obj_size > GC_SLICE_CHECK))
+            std::fill(&gc_marks[i + 1], &gc_marks[i + 1] + header.obj_size, is_raw_object(header) ? GC_MARK_RAW : GC_MARK_CELL);
+        return true;
+    }
+
+    void gc_mark_children(const Cell& c, std::vector<uint32_t>& work)
+    {
+        auto mark = [&](uint32_t i) { if (gc_try_mark(i)) work.push_back(i); };
+        if (c.type == Lambda) mark(c.lambda_env);
+        else if (c.type == Pair)
+        {
+            mark(c.pair_addr);
+            mark(c.pair_addr + 1);
+        }
+        else if (c.type == Environment) mark(c.integer);
+        else if (is_object(c.type)) mark(c.obj_ref);
+    }
+
+    // plain cells are never Headers, so a Header address in the work list is an object
+    void gc_scan(uint32_t i, std::vector<uint32_t>& work)
+    {
+        const Cell& c = heap[i];
+        if (c.type != Header) gc_mark_children(c, work);
+        else if (!is_raw_object(c))
+        {
+            for (size_t k = 1; k <= c.obj_size; ++k)
+                gc_mark_children(heap[i + k], work);
+            // cached results live outside the heap, a Memo object keeps them alive
+            if (c.obj_kind == Memo)
+            {
+                const auto cache = memo_caches.find(heap[i + 1 + MemoCacheId].int_value());
+                if (cache != memo_caches.end() && cache->second.owner == i)
+                    for (const auto& entry : cache->second.entries)
+                        gc_mark_children(entry.second, work);
+            }
+        }
+    }
+
+    // caches of Memo objects which weren't marked are dropped before scavenging
+    void gc_sweep_memo_caches()
+    {
+        for (auto cache = memo_caches.begin(); cache != memo_caches.end();)
+            if (gc_marks[cache->second.owner]) ++cache;
+            else cache = memo_caches.erase(cache);
+    }
+
+    // marking thread 'self': roots are dealt round robin, then every thread traces from its own work list,
+    // handing half of it over when another thread is idle; marking ends when all threads are idle
+    void gc_mark_thread(size_t self, size_t threads, GcMarkQueue& queue)
+    {
+        std::vector<uint32_t> work;
+        if (!self && gc_try_mark(env_ptr)) work.push_back(env_ptr);
+        for (size_t i = self; i < stack_ptr; i += threads)
+            gc_mark_children(stack[i], work);
+        while (true)
+        {
+            while (!work.empty())
+            {
+                const uint32_t i = work.back();
+                work.pop_back();
+                gc_scan(i, work);
+                if (work.size() > GC_SHARE_THRESHOLD && queue.idle.load() && !queue.shared_size.load())
+                {
+                    std::lock_guard<std::mutex> lock(queue.lock);
+                    if (queue.shared.empty())
+                    {
+                        queue.shared.assign(work.begin(), work.begin() + work.size() / 2);
+                        work.erase(work.begin(), work.begin() + work.size() / 2);
+                        queue.shared_size = queue.shared.size();
+                    }
+                }
+            }
+            queue.idle += 1;
+            while (work.empty())
+            {
+                if (queue.shared_size.load())
+                {
+                    std::lock_guard<std::mutex> lock(queue.lock);
+                    if (!queue.shared.empty())
+                    {
+                        work.swap(queue.shared);
+                        queue.shared_size = 0;
+                        queue.idle -= 1;
+                    }
+                }
+                else if (queue.idle.load() == threads) return;
+                else std::this_thread::yield();
+            }
+        }
+    }
+
+    // rewrite heap addresses in a cell using forwarding addresses left in the old half
+    void gc_relocate(Cell& cell)
+    {
+        if (cell.type == Pair)
+            cell.pair_addr = heap[cell.pair_addr].as64;
+        else if (cell.type == Lambda)
+            cell.lambda_env = heap[cell.lambda_env].as64;
+        else if (cell.type == Environment)
+            cell.integer = heap[cell.integer].as64;
+        else if (is_object(cell.type))
+            cell.obj_ref = heap[cell.obj_ref].as64;
+    }
+
+    // live cells keep their address order in the new half: the old half is split into one chunk per thread,
+    // each chunk's live cells are counted, and the prefix sums give every thread its own to-space range
+    void gc_scavenge(size_t threads)
+    {
+        gc_sweep_memo_caches();
+        if (gc_cdr_first) return gc_scavenge_cdr_first();
+        // address 0 means "no address" (e.g. a lambda without env), so it is never given to a cell
+        const size_t offset = (gc_count & 1) ? 1 : (memory_size >> 1);
+        const size_t source_offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+        const size_t size = heap_ptr - source_offset;
+        std::vector<size_t> chunk(threads + 1), to(threads + 1);
+        for (size_t t = 0; t <= threads; ++t) chunk[t] = source_offset + size * t / threads;
+        parallel_for(threads, [&](size_t t)
+        {
+            size_t live = 0;
+            for (size_t i = chunk[t]; i < chunk[t + 1]; ++i) live += gc_marks[i] != 0;
+            to[t + 1] = live;
+        });
+        to[0] = offset;
+        for (size_t t = 0; t < threads; ++t) to[t + 1] += to[t];
+        gc_collected += size - (to[threads] - offset);
+        // copy, saving relocation info in the old cells
+        parallel_for(threads, [&](size_t t)
+        {
+            for (size_t i = chunk[t], k = to[t]; i < chunk[t + 1]; ++i)
+                if (gc_marks[i])
+                {
+                    heap[k] = heap[i];
+                    heap[i].as64 = k++;
+                }
+        });
+        // fix relocations, every forwarding address is in place now
+        parallel_for(threads, [&](size_t t)
+        {
+            for (size_t i = chunk[t], k = to[t]; i < chunk[t + 1]; ++i)
+                if (gc_marks[i])
+                {
+                    if (gc_marks[i] == GC_MARK_CELL) gc_relocate(heap[k]);
+                    k += 1;
+                }
+            std::fill(&gc_marks[chunk[t]], &gc_marks[0] + chunk[t + 1], 0);
+        });
+        for (int i = 0; i < stack_ptr; ++i)
+            gc_relocate(stack[i]);
+        // save new mp
+        heap_ptr = to[threads];
+        // fix ep
+        env_ptr = heap[env_ptr].as64;
+        for (auto& cache : memo_caches)
+        {
+            cache.second.owner = heap[cache.second.owner].as64;
+            for (auto& entry : cache.second.entries)
+                gc_relocate(entry.second);
         }
-        else if (op == "RET")
+    }
+
+    // vm -l: marked cells are copied from the roots breadth first (Cheney's scan), except that a pair is
+    // followed at once by the pairs of its cdr chain, so a list's spine ends up contiguous and car/cdr walks
+    // read consecutive cells. Pairs, objects and single cells (env cells) are copied as units; a pair is a
+    // unit when a live Pair references its car cell, which a pass over the marked cells records first.
+    void gc_scavenge_cdr_first()
+    {
+        const size_t offset = (gc_count & 1) ? 1 : (memory_size >> 1);
+        const size_t source_offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+        const size_t size = heap_ptr - source_offset;
+        for (size_t i = source_offset; i < heap_ptr; ++i)
+            if ((gc_marks[i] & (GC_MARK_CELL | GC_MARK_RAW)) == GC_MARK_CELL && heap[i].type == Pair)
+                gc_marks[heap[i].pair_addr] |= GC_MARK_PAIR;
+        for (size_t i = 0; i < stack_ptr; ++i)
+            if (stack[i].type == Pair) gc_marks[stack[i].pair_addr] |= GC_MARK_PAIR;
+        for (const auto& cache : memo_caches)
+            for (const auto& entry : cache.second.entries)
+                if (entry.second.type == Pair) gc_marks[entry.second.pair_addr] |= GC_MARK_PAIR;
+        size_t free = offset;
+        auto copy = [&](uint32_t from)
         {
-            const size_t stack_ptr_offset = std::stoi(tokens[1]);
-            frame_ptr = stack[--stack_ptr].integer;
-            env_ptr = stack[--stack_ptr].integer;
-            pc = stack[--stack_ptr].integer;
-            stack_ptr -= stack_ptr_offset;
-            dont_step_pc = true;
-        }
-        else if (op == "POP")
+            const size_t n = heap[from].type == Header ? heap[from].obj_size + 1 : (gc_marks[from] & GC_MARK_PAIR) ? 2 : 1;
+            const uint32_t to = free;
+            std::copy(&heap[from], &heap[from] + n, &heap[to]);
+            for (size_t k = 0; k < n; ++k)
+            {
+                heap[from + k].as64 = to + k;
+                gc_marks[from + k] |= GC_MARK_MOVED;
+            }
+            free += n;
+            return to;
+        };
+        // returns the new address of cell 'i', copying its unit (the pair it is the cdr of, if any) first
+        auto forward = [&](uint32_t i) -> uint32_t
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
-            stack_ptr -= 1;
+            if (gc_marks[i] & GC_MARK_MOVED) return heap[i].as64;
+            const bool cdr = !(gc_marks[i] & GC_MARK_PAIR) && i > source_offset && (gc_marks[i - 1] & GC_MARK_PAIR);
+            uint32_t to = copy(cdr ? i - 1 : i);
+            if (gc_marks[cdr ? i - 1 : i] & GC_MARK_PAIR)
+                while (heap[to + 1].type == Pair && !(gc_marks[heap[to + 1].pair_addr] & GC_MARK_MOVED))
+                    to = copy(heap[to + 1].pair_addr);
+            return heap[i].as64;
+        };
+        auto relocate = [&](Cell& cell)
+        {
+            if (cell.type == Pair) cell.pair_addr = forward(cell.pair_addr);
+            else if (cell.type == Lambda && cell.lambda_env) cell.lambda_env = forward(cell.lambda_env);
+            else if (cell.type == Environment) cell.integer = forward(cell.integer);
+            else if (is_object(cell.type)) cell.obj_ref = forward(cell.obj_ref);
+        };
+        env_ptr = forward(env_ptr);
+        for (size_t i = 0; i < stack_ptr; ++i)
+            relocate(stack[i]);
+        for (auto& cache : memo_caches)
+        {
+            cache.second.owner = forward(cache.second.owner);
+            for (auto& entry : cache.second.entries)
+                relocate(entry.second);
         }
-        else if (op == "CAR" || op == "CDR")
+        for (size_t scan = offset; scan < free;)
         {
-            if (!stack_ptr) return panic(op, "Empty stack");
-            Cell& cell = stack[stack_ptr - 1];
-            if (cell.type != Pair) return panic(op, "Type mismatch");
-            cell = heap[op == "CAR" ? cell.left : cell.right];
+            if (heap[scan].type == Header && is_raw_object(heap[scan])) scan += heap[scan].obj_size + 1;
+            else relocate(heap[scan++]);
         }
-        else if (op == "SWAP")
+        std::fill(&gc_marks[source_offset], &gc_marks[0] + heap_ptr, 0);
+        gc_collected += size - (free - offset);
+        heap_ptr = free;
+    }
+
+    // incremental mode uses tri-color marking: unmarked cells are white, marked cells in gc_gray or above
+    // gc_scan_ptr are gray, other marked cells are black. Stores of references into cells which may be black
+    // shade the referenced cell (a Dijkstra write barrier), so a black cell never points to a white one.
+    void gc_write_barrier(const Cell& value)
+    {
+        if (gc_marking) gc_mark_children(value, gc_gray);
+    }
+
+    // called after a store into heap[addr], a cell allocated before the current instruction: the stored
+    // value is shaded while marking, and the cell is copied again if it was evacuated already
+    void gc_store_barrier(uint32_t addr)
+    {
+        if (gc_marking) gc_mark_children(heap[addr], gc_gray);
+        else if (gc_evacuating && addr < gc_copy_ptr && !(gc_marks[addr] & GC_MARK_DIRTY))
         {
-            // TODO: check swap argument and issue panic in case needed
-            const uint32_t elno = stack_ptr - 2 - std::stoi(tokens[1]);
-            if (stack_ptr < 2) return panic(op, "Not enought elements on the stack");
-            Cell tmp = stack[stack_ptr - 1];
-            stack[stack_ptr - 1] = stack[elno];
-            stack[elno] = tmp;
+            gc_marks[addr] |= GC_MARK_DIRTY;
+            gc_dirty.push_back(addr);
         }
-        else if (op == "NOP")
+    }
+
+    // no incremental cycle is running and every mark is clear
+    bool gc_idle() const { return !gc_marking && !gc_evacuating && gc_clear_ptr == gc_clear_end; }
+
+    // scans cell 'i' for a marking slice, the payload of a large object is marked and scanned in pieces
+    void gc_scan_slice(uint32_t i)
+    {
+        const Cell& c = heap[i];
+        if (c.type != Header || c.obj_size <= GC_SLICE_CHECK) return gc_scan(i, gc_gray);
+        gc_object_ptr = i + 1;
+        gc_object_end = i + 1 + c.obj_size;
+        gc_object_raw = is_raw_object(c);
+    }
+
+    // blackens gray cells until none are left (returns true) or 'deadline' passes; the stack is scanned
+    // along with them, it is scanned again in one piece at the end (see gc_remark)
+    bool gc_mark_slice(std::chrono::steady_clock::time_point deadline)
+    {
+        for (size_t work = 0; ; )
         {
+            if (gc_object_ptr < gc_object_end)
+            {
+                const uint32_t end = std::min<uint32_t>(gc_object_end, gc_object_ptr + GC_SLICE_CHECK);
+                std::fill(&gc_marks[gc_object_ptr], &gc_marks[0] + end, gc_object_raw ? GC_MARK_RAW : GC_MARK_CELL);
+                if (!gc_object_raw)
+                    for (uint32_t k = gc_object_ptr; k < end; ++k)
+                        gc_mark_children(heap[k], gc_gray);
+                work += end - gc_object_ptr;
+                gc_object_ptr = end;
+            }
+            else if (gc_root_ptr < stack_ptr) gc_mark_children(stack[gc_root_ptr++], gc_gray), work += 1;
+            else if (!gc_gray.empty())
+            {
+                const uint32_t i = gc_gray.back();
+                gc_gray.pop_back();
+                gc_scan_slice(i);
+                work += 1;
+            }
+            else if (gc_scan_ptr < heap_ptr)
+            {
+                // allocations complete before the next slice, so every cell below heap_ptr is initialized
+                const Cell& c = heap[gc_scan_ptr];
+                const uint32_t i = gc_scan_ptr;
+                gc_scan_ptr += c.type == Header ? c.obj_size + 1 : 1;
+                gc_try_mark(i);
+                gc_scan_slice(i);
+                work += 1;
+            }
+            else return true;
+            if (work >= GC_SLICE_CHECK)
+            {
+                work = 0;
+                if (std::chrono::steady_clock::now() > deadline) return false;
+            }
         }
-        if (!dont_step_pc) pc += 1;
-        ticks += 1;
     }
-    
-    void debug()
+
+    // the stack and env_ptr are written without barriers, so once nothing is gray they are scanned again
+    // in one piece; marking is done if that finds nothing new
+    bool gc_remark()
     {
-        cout << "Disassembly:" << endl;
-        jit_dump_function(stdout, main, "program");
-        const size_t offset = (gc_count & 1) ? (MEMORY_SIZE >> 1) : 0;
-        cout << "PC: " << pc << endl;
-        cout << "Ticks: " << ticks << endl;
-        cout << "JIT time: " << jit_time << " ms" << endl;
-        cout << "Execution time: " << execution_time<< " ms" << endl;
-        cout << "GC ran: " << gc_count << " time(s)" << endl;
-        cout << "  Collected: " << gc_collected << " cells" << endl;
-        cout << "Environment pointer: " << env_ptr << endl;
-        cout << "Stack size: " << stack_ptr << endl;
-        cout << "Memory size: " << heap_ptr - offset << endl;
-        cout << "Stack:" <<  endl;
-        for (int i = stack_ptr - 1; i >= 0; --i)
-            cout << "    " << stack[i].pp() << endl;
-        // cout << "Memory:" << endl;
-        // for (int i = offset; i < heap_ptr; ++i)
-        //     cout << "    " << heap[i].pp() << endl;
+        if (gc_try_mark(env_ptr)) gc_gray.push_back(env_ptr);
+        for (size_t i = 0; i < stack_ptr; ++i)
+            gc_mark_children(stack[i], gc_gray);
+        return gc_gray.empty();
     }
 
-    void gc_mark_recursive(Cell& c)
+    // marking is done: the old half is evacuated in slices, or scavenged at once in cdr-first order (vm -l)
+    void gc_end_marking()
     {
-        if (c.as64 & 0x8000000000000000ull) return;
-        const Cell tmp = c;
-        c.as64 |= 0x8000000000000000ull;
-        if (tmp.type == Lambda) gc_mark_recursive(heap[tmp.lambda_env]);
-        else if (tmp.type == Pair)
+        gc_marking = false;
+        gc_sweep_memo_caches();
+        if (gc_cdr_first)
         {
-            gc_mark_recursive(heap[tmp.left]);
-            gc_mark_recursive(heap[tmp.right]);
+            gc_scavenge(1);
+            gc_count += 1;
+            return;
         }
-        else if (tmp.type == Environment)
+        gc_evacuating = true;
+        gc_source = (gc_count & 1) ? (memory_size >> 1) : 0;
+        gc_mark_end = heap_ptr;
+        gc_copy_ptr = gc_source;
+        gc_copy_to = gc_relocate_ptr = (gc_count & 1) ? 1 : (memory_size >> 1);
+        // the block tables are filled in order as cells are copied, so their pages are touched in slices too
+        gc_block_to.clear();
+        gc_block_live.clear();
+        gc_block_to.reserve((memory_size >> 7) + 1);
+        gc_block_live.reserve((memory_size >> 7) + 1);
+        // a cell is queued for copying again once at a time (GC_MARK_DIRTY), so gc_dirty fits too
+        gc_dirty.clear();
+        gc_dirty.reserve(memory_size >> 1);
+    }
+
+    // copies old cell 'i' if it is live, its block's entries are started at the block's first cell
+    void gc_copy(uint32_t i)
+    {
+        const uint32_t k = i - gc_source;
+        if (k % 64 == 0)
         {
-            gc_mark_recursive(heap[tmp.as64 & 0x0FFFFFFFFFFFFFFFull]);
+            gc_block_to.push_back(gc_copy_to);
+            gc_block_live.push_back(0);
         }
+        if (!gc_marks[i] && i < gc_mark_end) return;
+        gc_block_live[k / 64] |= 1ull << (k % 64);
+        heap[gc_copy_to++] = heap[i];
     }
 
-    size_t gc_mark()
+    // new address of old cell 'i', which has been copied
+    uint32_t gc_forward(uint32_t i)
     {
-        gc_mark_recursive(heap[env_ptr]);
-        for (int i = 0; i < stack_ptr; ++i)
-            gc_mark_recursive(stack[i]);
-        for (int i = 0; i < stack_ptr; ++i)
-            stack[i].as64 &= 0x7FFFFFFFFFFFFFFFull;
-        // count used, optional, for stats only
-        size_t unused = 0;
-        const size_t offset = (gc_count & 1) ? (MEMORY_SIZE >> 1) : 0;
-        for (int i = offset; i < heap_ptr; ++i)
-            if ((heap[i].as64 & 0x8000000000000000ull) == 0) 
-                unused += 1;
-        return unused;
-    }
-
-    void gc_scavenge()
-    {
-        size_t new_heap_ptr = 0;
-        const size_t offset = (gc_count & 1) ? 0 : (MEMORY_SIZE >> 1);
-        const size_t source_offset = (gc_count & 1) ? (MEMORY_SIZE >> 1) : 0;
-        Cell* new_heap = &heap[offset], *cur_heap = new_heap;
-        for (int i = source_offset; i < heap_ptr; ++i)
-        {
-            Cell& cell = heap[i];
-            if (cell.as64 & 0x8000000000000000ull)
+        const uint32_t k = i - gc_source;
+        return gc_block_to[k / 64] + __builtin_popcountll(gc_block_live[k / 64] & ((1ull << (k % 64)) - 1));
+    }
+
+    void gc_forward_cell(Cell& cell)
+    {
+        if (cell.type == Pair) cell.pair_addr = gc_forward(cell.pair_addr);
+        else if (cell.type == Lambda && cell.lambda_env) cell.lambda_env = gc_forward(cell.lambda_env);
+        else if (cell.type == Environment && cell.integer) cell.integer = gc_forward(cell.integer);
+        else if (is_object(cell.type)) cell.obj_ref = gc_forward(cell.obj_ref);
+    }
+
+    // one slice of evacuation. The program keeps running on the old half: live cells (marked ones and those
+    // allocated since marking ended) are copied to the new half in address order, cells written after they
+    // were copied are copied again, and once everything is copied the copies' references are relocated.
+    // Returns true when the roots have been switched to the new half, which takes one pass over the stack
+    // and the memo caches.
+    bool gc_evacuate_slice(std::chrono::steady_clock::time_point deadline)
+    {
+        for (size_t work = 0; ; )
+        {
+            if (gc_copy_ptr < heap_ptr)
             {
-                // copy the cell clearing 'reachable' bit
-                *cur_heap = cell.as64 & 0x7FFFFFFFFFFFFFFFull;
-                // save relocation info in the old cell, saving 'reachable' bit
-                cell.as64 = (cur_heap - new_heap + offset) & 0x8FFFFFFFFFFFFFFFull;
-                cur_heap += 1;
+                const uint32_t end = std::min<uint32_t>(heap_ptr, gc_copy_ptr + GC_SLICE_CHECK);
+                work += end - gc_copy_ptr;
+                for (; gc_copy_ptr < end; ++gc_copy_ptr) gc_copy(gc_copy_ptr);
             }
-        }
-        heap_ptr = cur_heap - new_heap;
-        // fix relocations
-        cur_heap = new_heap;
-        // stack
-        for (int i = 0; i < stack_ptr; ++i)
-        {
-            Cell& cell = stack[i];
-            if (cell.type == Pair)
+            else if (!gc_dirty.empty())
             {
-                cell.left = heap[cell.left].as64 & 0x7FFFFFFFFFFFFFFFull;
-                cell.right = heap[cell.right].as64 & 0x7FFFFFFFFFFFFFFFull;
+                const uint32_t i = gc_dirty.back();
+                gc_dirty.pop_back();
+                gc_marks[i] &= ~GC_MARK_DIRTY;
+                const uint32_t to = gc_forward(i);
+                heap[to] = heap[i];
+                if (to < gc_relocate_ptr) gc_forward_cell(heap[to]);
+                work += 1;
             }
-            else if (cell.type == Lambda)
-                cell.lambda_env = heap[cell.lambda_env].as64 & 0x7FFFFFFFFFFFFFFFull;
-            else if (cell.type == Environment)
-                cell.as64 = (heap[cell.as64 & 0x7FFFFFFFFFFFFFFFull].as64) | 0x6000000000000000ull;
-        }
-        // heap
-        for (int i = 0; i < heap_ptr; ++i)
-        {
-            Cell& cell = *cur_heap++;
-            if (cell.type == Pair)
+            else if (gc_relocate_ptr < gc_copy_to)
+            {
+                // references are only relocated once every cell they may point to has been copied
+                Cell& c = heap[gc_relocate_ptr];
+                if (c.type == Header) gc_relocate_ptr += is_raw_object(c) ? c.obj_size + 1 : 1;
+                else gc_forward_cell(heap[gc_relocate_ptr++]);
+                work += 1;
+            }
+            else
             {
-                cell.left = heap[cell.left].as64 & 0x7FFFFFFFFFFFFFFFull;
-                cell.right = heap[cell.right].as64 & 0x7FFFFFFFFFFFFFFFull;
+                gc_flip();
+                return true;
             }
-            else if (cell.type == Lambda)
+            if (work >= GC_SLICE_CHECK)
             {
-                cell.lambda_env = heap[cell.lambda_env].as64 & 0x7FFFFFFFFFFFFFFFull;
+                work = 0;
+                if (std::chrono::steady_clock::now() > deadline) return false;
             }
         }
-        // save new mp
-        heap_ptr = cur_heap - new_heap + offset;
-        // fix ep
-        env_ptr = heap[env_ptr].as64 & 0x7FFFFFFFFFFFFFFFull;
     }
 
-    void gc()
+    // switches to the new half, the marks of the old one are cleared by the next slices
+    void gc_flip()
     {
-        const size_t unused = gc_mark();
-        gc_collected += unused;
-        gc_scavenge();
+        for (size_t i = 0; i < stack_ptr; ++i)
+            gc_forward_cell(stack[i]);
+        env_ptr = gc_forward(env_ptr);
+        for (auto& cache : memo_caches)
+        {
+            cache.second.owner = gc_forward(cache.second.owner);
+            for (auto& entry : cache.second.entries)
+                gc_forward_cell(entry.second);
+        }
+        const uint32_t to_start = (gc_count & 1) ? 1 : (memory_size >> 1);
+        gc_collected += (heap_ptr - gc_source) - (gc_copy_to - to_start);
+        gc_clear_ptr = gc_source;
+        gc_clear_end = heap_ptr;
+        heap_ptr = gc_copy_to;
         gc_count += 1;
+        gc_evacuating = false;
+    }
+
+    // returns true when the marks left by the last cycle are clear
+    bool gc_clear_marks(std::chrono::steady_clock::time_point deadline)
+    {
+        while (gc_clear_ptr < gc_clear_end)
+        {
+            const uint32_t end = std::min<uint32_t>(gc_clear_end, gc_clear_ptr + GC_CLEAR_CHUNK);
+            std::fill(&gc_marks[gc_clear_ptr], &gc_marks[0] + end, 0);
+            gc_clear_ptr = end;
+            if (std::chrono::steady_clock::now() > deadline) break;
+        }
+        return gc_clear_ptr == gc_clear_end;
+    }
+
+    // finishes an incremental cycle at once, for a full collection or when the heap runs full
+    void gc_finish_cycle()
+    {
+        const auto never = std::chrono::steady_clock::time_point::max();
+        if (gc_marking)
+        {
+            while (!gc_mark_slice(never) || !gc_remark()) { }
+            gc_end_marking();
+        }
+        if (gc_evacuating) gc_evacuate_slice(never);
+        gc_clear_marks(never);
+    }
+
+    // called at allocation points in incremental mode: a cycle starts when half of the current half of the
+    // heap is in use, then each call does one slice of at most about gc_budget us, marking and then
+    // evacuating. Cells allocated during the cycle are black.
+    void gc_increment()
+    {
+        const size_t used = heap_ptr - ((gc_count & 1) ? (memory_size >> 1) : 0);
+        if (gc_idle() && used < (memory_size >> 2)) return;
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + std::chrono::microseconds(gc_budget);
+        if (gc_clear_ptr < gc_clear_end) gc_clear_marks(deadline);
+        else if (gc_evacuating) gc_evacuate_slice(deadline);
+        else if (!gc_marking)
+        {
+            gc_marking = true;
+            gc_scan_ptr = heap_ptr;
+            gc_root_ptr = 0;
+            // a cell is grayed once per cycle, with room for all of them the stack never grows in a slice
+            gc_gray.reserve(memory_size >> 1);
+            if (gc_try_mark(env_ptr)) gc_gray.push_back(env_ptr);
+        }
+        else if (gc_mark_slice(deadline) && gc_remark()) gc_end_marking();
+        const size_t pause = gc_record_pause(start);
+        gc_slices += 1;
+        gc_slice_max = std::max(gc_slice_max, pause);
+        gc_over_budget += pause > gc_budget;
+    }
+
+    size_t gc_record_pause(std::chrono::steady_clock::time_point start)
+    {
+        const size_t pause = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        gc_pause_total += pause;
+        gc_pause_max = std::max(gc_pause_max, pause);
+        return pause;
+    }
+
+    // collects the live heap into the start of the first half and writes it with env_ptr and the program,
+    // the heap starts at a page boundary in the file so load_image can map it; the stack is dropped
+    bool dump_image(const std::string& file, const std::vector<std::string>& code)
+    {
+        stack_ptr = 0;
+        gc();
+        if (gc_count & 1) gc();
+        std::string text;
+        for (const auto& line : code) text += line + "\n";
+        ImageHeader header;
+        memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+        header.heap_size = heap_ptr;
+        header.env_ptr = env_ptr;
+        header.text_size = text.size();
+        std::ofstream out(file, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(std::string(IMAGE_HEAP_OFFSET - sizeof(header), 0).data(), IMAGE_HEAP_OFFSET - sizeof(header));
+        out.write(reinterpret_cast<const char*>(&heap[0]), heap_ptr * sizeof(Cell));
+        out.write(text.data(), text.size());
+        return bool(out);
+    }
+
+    // maps an image's heap over the start of the first half, copy-on-write, so only the pages the
+    // program touches are read; returns false if 'file' is not an image
+    bool load_image(const std::string& file, std::vector<std::string>& code)
+    {
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        ImageHeader header;
+        bool loaded = read(fd, &header, sizeof(header)) == sizeof(header) &&
+                      !memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) && header.heap_size <= (memory_size >> 1);
+        std::string text(loaded ? header.text_size : 0, 0);
+        loaded = loaded && pread(fd, &text[0], text.size(), IMAGE_HEAP_OFFSET + header.heap_size * sizeof(Cell)) == ssize_t(text.size());
+        if (loaded)
+        {
+            reset();
+            loaded = mmap(&heap[0], header.heap_size * sizeof(Cell), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, fd, IMAGE_HEAP_OFFSET) != MAP_FAILED;
+            heap_ptr = header.heap_size;
+            env_ptr = header.env_ptr;
+        }
+        close(fd);
+        std::istringstream in(text);
+        code = read_program(in);
+        return loaded;
+    }
+
+    // seals the Vectors and Hashes reachable from env_ptr and the stack, so stores into them panic;
+    // uses the GC marks, which are clear outside of a collection
+    void seal_objects()
+    {
+        if (!gc_idle()) gc();
+        std::vector<uint32_t> work;
+        if (gc_try_mark(env_ptr)) work.push_back(env_ptr);
+        for (size_t i = 0; i < stack_ptr; ++i)
+            gc_mark_children(stack[i], work);
+        while (!work.empty())
+        {
+            const uint32_t i = work.back();
+            work.pop_back();
+            Cell& c = heap[i];
+            if (c.type == Header && (c.obj_kind == Vector || c.obj_kind == Hash)) c.obj_aux |= OBJ_SEALED;
+            gc_scan(i, work);
+        }
+        std::fill(gc_marks.begin(), gc_marks.end(), 0);
+    }
+
+    // a full collection, it finishes a running incremental cycle at once
+    void gc()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (gc_marking || gc_evacuating) gc_finish_cycle();
+        else
+        {
+            gc_clear_marks(std::chrono::steady_clock::time_point::max());
+            // small heaps aren't worth starting threads for
+            const size_t source_offset = (gc_count & 1) ? (memory_size >> 1) : 0;
+            const size_t threads = std::max<size_t>(1, std::min<size_t>(gc_threads, (heap_ptr - source_offset) / GC_MIN_CELLS_PER_THREAD));
+            GcMarkQueue queue;
+            parallel_for(threads, [&](size_t t) { gc_mark_thread(t, threads, queue); });
+            gc_scavenge(threads);
+            gc_count += 1;
+        }
+        gc_record_pause(start);
     }
 
 #if WITH_JIT
+    // address of heap cell 'index', computed in 64 bits since the heap may be larger than 4 GB
+    jit_value_t jit_heap_cell(jit_value_t index)
+    {
+        return jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, jit_insn_convert(main, index, jit_type_ulong, 0), c8));
+    }
+
     void init_jit()
     {
         ctx = jit_context_create();
@@ -585,7 +3075,7 @@ struct VM
         // bind jit memory
         jit_constant_t memory_addr_const;
         memory_addr_const.type = jit_type_void_ptr;
-        memory_addr_const.un.ptr_value = &heap[0]; // 0 - nil, 1 - env, 2 .. MEMORY_SIZE - memory
+        memory_addr_const.un.ptr_value = &heap[0]; // 0 - nil, 1 - env, 2 .. memory_size - memory
         jit_memory_addr = jit_value_create_constant(main, &memory_addr_const);
         // bind jit stack pointer
         jit_constant_t stack_ptr_const;
@@ -612,6 +3102,19 @@ struct VM
         env_ptr_const.type = jit_type_void_ptr;
         env_ptr_const.un.ptr_value = &env_ptr;
         jit_env_ptr = jit_value_create_constant(main, &env_ptr_const);
+        // constants
+        c8 = jit_value_create_nint_constant(main, jit_type_uint, 8);
+        c2 = jit_value_create_nint_constant(main, jit_type_uint, 2);
+        c1 = jit_value_create_nint_constant(main, jit_type_uint, 1);
+        cm1 = jit_value_create_nint_constant(main, jit_type_int, -1);
+        cm2 = jit_value_create_nint_constant(main, jit_type_int, -2);
+        cm3 = jit_value_create_nint_constant(main, jit_type_int, -3);
+        ctypemask = jit_value_create_long_constant(main, jit_type_ulong, 0xF000000000000000l);
+        cfamilymask = jit_value_create_long_constant(main, jit_type_ulong, TYPE_FAMILY_MASK);
+        cinttype = jit_value_create_long_constant(main, jit_type_ulong, Cell::make_integer(0).as64);
+        c4 = jit_value_create_nint_constant(main, jit_type_uint, 4);
+        cdatamask = jit_value_create_long_constant(main, jit_type_ulong, 0x0FFFFFFFFFFFFFFFl);
+        cmemthreshold = jit_value_create_nint_constant(main, jit_type_uint, (memory_size >> 1) - 3);
     }
 
     void prepare_jump_table(const std::vector<std::string>& program)
@@ -633,26 +3136,35 @@ struct VM
              }
             local_pc += 1;
         }
+        jit_jump_pcs.resize(jit_jump_map.size());
+        for (const auto& x : jit_jump_map) jit_jump_pcs[x.second] = x.first;
         jit_jump_table.resize(jit_jump_map.size());
         for (auto& x : jit_jump_table) x = jit_label_undefined;
     }
 
+    // slow path: call back into the interpreter to execute a single non control flow instruction
+    void jit_emit_interpret(const std::string& instruction)
+    {
+        jit_type_t type[] = { jit_type_void_ptr, jit_type_void_ptr };
+        jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, type, 2, 1);
+        jit_constant_t vm_const, instruction_const;
+        vm_const.type = jit_type_void_ptr;
+        vm_const.un.ptr_value = this;
+        instruction_const.type = jit_type_void_ptr;
+        instruction_const.un.ptr_value = const_cast<char*>(instruction.c_str());
+        jit_value_t args[] = { jit_value_create_constant(main, &vm_const), jit_value_create_constant(main, &instruction_const) };
+        jit_insn_call_native(main, "interpret", reinterpret_cast<void*>(&jit_vm_interpret), signature, args, 2, JIT_CALL_NOTHROW);
+    }
+
     void step_jit(const std::string& instruction)
     {
         auto tokens = tokenize(instruction);
         if (tokens.empty()) return;
 
-        static jit_value_t c8 = jit_value_create_nint_constant(main, jit_type_uint, 8);
-        static jit_value_t c2 = jit_value_create_nint_constant(main, jit_type_uint, 2);
-        static jit_value_t c1 = jit_value_create_nint_constant(main, jit_type_uint, 1);
-        static jit_value_t cm1 = jit_value_create_nint_constant(main, jit_type_int, -1);
-        static jit_value_t cm2 = jit_value_create_nint_constant(main, jit_type_int, -2);
-        static jit_value_t cm3 = jit_value_create_nint_constant(main, jit_type_int, -3);
-        static jit_value_t ctypemask = jit_value_create_long_constant(main, jit_type_ulong, 0xF000000000000000l);
-        static jit_value_t cdatamask = jit_value_create_long_constant(main, jit_type_ulong, 0x0FFFFFFFFFFFFFFFl);
-        static jit_value_t cmemthreshold = jit_value_create_nint_constant(main, jit_type_uint, (MEMORY_SIZE >> 1) - 3);
-
-        const std::string op = tokens[0];
+        // the inline path checks for Int operands anyway, as BigInts go to the slow path, so unchecked
+        // arithmetic (ADD.i...) is compiled like the checked instruction
+        std::string op = tokens[0];
+        if (op.size() > 2 && op.compare(op.size() - 2, 2, ".i") == 0) op.resize(op.size() - 2);
 
         // create new block for each instruction
         // jit_insn_new_block(main);
@@ -669,7 +3181,7 @@ struct VM
             jit_value_t gcc = jit_insn_load_relative(main, jit_gc_count_ptr, 0, jit_type_uint);
             gcc = jit_insn_eq(main, jit_insn_and(main, gcc, c1), c1);
             jit_insn_branch_if_not(main, gcc, &first_half);
-            mp = jit_insn_sub(main, mp, jit_value_create_nint_constant(main, jit_type_uint, MEMORY_SIZE >> 1));
+            mp = jit_insn_sub(main, mp, jit_value_create_nint_constant(main, jit_type_uint, memory_size >> 1));
             jit_insn_label(main, &first_half);
             jit_value_t needs_gc = jit_insn_gt(main, mp, cmemthreshold);
             jit_insn_branch_if(main, needs_gc, &run_gc);
@@ -702,8 +3214,11 @@ struct VM
         }
         else if (op == "PRN" || op == "PRNL")
         {
-            jit_type_t type[] = { jit_type_ulong };
-            jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, type, 1, 1);
+            jit_type_t type[] = { jit_type_void_ptr, jit_type_ulong };
+            jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, type, 2, 1);
+            jit_constant_t vm_const;
+            vm_const.type = jit_type_void_ptr;
+            vm_const.un.ptr_value = this;
             jit_value_t val;
             if (op == "PRNL")
             {
@@ -718,14 +3233,17 @@ struct VM
                 jit_insn_store_relative(main, jit_stack_ptr, 0, sp1);
                 val = jit_insn_load_relative(main, sp_addr, 0, jit_type_ulong);
             }
-            jit_insn_call_native(main, "print", reinterpret_cast<void*>(&vm_print_cell), signature, &val, 1, JIT_CALL_NOTHROW);
+            jit_value_t args[] = { jit_value_create_constant(main, &vm_const), val };
+            jit_insn_call_native(main, "print", reinterpret_cast<void*>(&jit_vm_print), signature, args, 2, JIT_CALL_NOTHROW);
         }
+        // integer literals not fitting into an Int cell are allocated on the heap at run time
+        else if (op == "PUSHCI" && tokens[1].size() >= 18) jit_emit_interpret(instruction);
         else if (op == "PUSHCI" || op == "PUSHNIL" || op == "PUSHS" || op == "PUSHL")
         {
             // increment sp
             Cell cell;
             jit_value_t cellval;
-            if (op == "PUSHCI") cell = Cell::make_integer(std::stoi(tokens[1]));
+            if (op == "PUSHCI") cell = Cell::make_integer(std::stoll(tokens[1]));
             else if(op == "PUSHNIL") cell = Cell::make_nil();
             else if(op == "PUSHS") cell = Cell::make_string(tokens[1]);
             else if(op == "PUSHL") 
@@ -746,7 +3264,6 @@ struct VM
             if (op == "PUSHL" && std::stoi(tokens[1]) != -1) 
             {
                 jit_value_t ep = jit_insn_convert(main, jit_insn_load_relative(main, jit_env_ptr, 0, jit_type_uint), jit_type_ulong, 0);
-                ep = jit_insn_shl(main, ep, jit_value_create_nint_constant(main, jit_type_uint, 32));
                 cellval = jit_insn_or(main, cellval, ep);
             }
             // current sp
@@ -772,8 +3289,27 @@ struct VM
             // load sp-1 snd sp-2 values, save v1 type and clear type bits on both values
             jit_value_t v1t = jit_insn_load_relative(main, v1_addr, 0, jit_type_long);
             jit_value_t v2t = jit_insn_load_relative(main, v2_addr, 0, jit_type_long);
-            jit_value_t v1 = jit_insn_and(main, v1t, cdatamask);
-            jit_value_t v2 = jit_insn_and(main, v2t, cdatamask);
+            jit_label_t slow_path = jit_label_undefined, done = jit_label_undefined;
+            // the inline path handles Int operands only, BigInt and type errors go through the interpreter
+            if (op != "EQT")
+            {
+                jit_value_t v1nint = jit_insn_ne(main, jit_insn_and(main, v1t, ctypemask), cinttype);
+                jit_value_t v2nint = jit_insn_ne(main, jit_insn_and(main, v2t, ctypemask), cinttype);
+                jit_insn_branch_if(main, jit_insn_or(main, v1nint, v2nint), &slow_path);
+            }
+            // sign extend 60 bit integers
+            jit_value_t v1 = jit_insn_sshr(main, jit_insn_shl(main, v1t, c4), c4);
+            jit_value_t v2 = jit_insn_sshr(main, jit_insn_shl(main, v2t, c4), c4);
+            if (op == "MUL")
+            {
+                // keep the product within 64 bits: both operands must be in [-2^29, 2^29)
+                jit_value_t bias = jit_value_create_long_constant(main, jit_type_long, 1ll << 29);
+                jit_value_t limit = jit_value_create_long_constant(main, jit_type_ulong, (1ll << 30) - 1);
+                jit_value_t v1big = jit_insn_gt(main, jit_insn_convert(main, jit_insn_add(main, v1, bias), jit_type_ulong, 0), limit);
+                jit_value_t v2big = jit_insn_gt(main, jit_insn_convert(main, jit_insn_add(main, v2, bias), jit_type_ulong, 0), limit);
+                jit_insn_branch_if(main, jit_insn_or(main, v1big, v2big), &slow_path);
+            }
+            if (op == "DIV" || op == "MOD") jit_insn_branch_if_not(main, v1, &slow_path);
             jit_value_t r;
             if (op == "ADD") r = jit_insn_add(main, v1, v2);
             else if (op == "SUB") r = jit_insn_sub(main, v2, v1);
@@ -781,11 +3317,12 @@ struct VM
             else if (op == "DIV") r = jit_insn_div(main, v2, v1);
             else if (op == "MOD") r = jit_insn_rem(main, v2, v1);
             else if (op == "EQ")  r = jit_insn_eq(main, v1, v2);
-            else if (op == "LT")  r = jit_insn_lt(main, v2, v1); // TODO: check this
-            else if (op == "EQT") r = jit_insn_eq(main, jit_insn_and(main, v1t, ctypemask), jit_insn_and(main, v2t, ctypemask));
-            // and fix type in case result occupies more than 60 bits
-            jit_value_t rf = jit_insn_or(main, jit_insn_and(main, r, cdatamask), 
-                                            jit_value_create_long_constant(main, jit_type_ulong, Cell::make_integer(0).as64));
+            else if (op == "LT")  r = jit_insn_lt(main, v2, v1);
+            else if (op == "EQT") r = jit_insn_eq(main, jit_insn_and(main, v1t, cfamilymask), jit_insn_and(main, v2t, cfamilymask));
+            // results not fitting into 60 bits become BigInt
+            if (op == "ADD" || op == "SUB" || op == "MUL" || op == "DIV")
+                jit_insn_branch_if(main, jit_insn_ne(main, jit_insn_sshr(main, jit_insn_shl(main, r, c4), c4), r), &slow_path);
+            jit_value_t rf = jit_insn_or(main, jit_insn_and(main, r, cdatamask), cinttype);
             // store value on top of the stack
              // EQT operations doesn't pop operands from stack
             if (op == "EQT") v2_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp, c8));
@@ -793,6 +3330,13 @@ struct VM
             // modify sp
             if (op == "EQT") sp_1 = jit_insn_add(main, sp, c1);
             jit_insn_store_relative(main, jit_stack_ptr, 0, sp_1);
+            if (op != "EQT")
+            {
+                jit_insn_branch(main, &done);
+                jit_insn_label(main, &slow_path);
+                jit_emit_interpret(instruction);
+                jit_insn_label(main, &done);
+            }
         }
         else if (op == "POP")
         {
@@ -813,16 +3357,13 @@ struct VM
             // migrate values to memory and modify mp
             jit_value_t mp = jit_insn_convert(main, jit_insn_load_relative(main, jit_memory_ptr, 0, jit_type_uint), jit_type_ulong, 0);
             jit_value_t mp1 = jit_insn_add(main, mp, c1);
-            jit_value_t v1m_addr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, mp, c8));
-            jit_value_t v2m_addr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, mp1, c8));
+            jit_value_t v1m_addr = jit_heap_cell(mp);
+            jit_value_t v2m_addr = jit_heap_cell(mp1);
             jit_insn_store_relative(main, v1m_addr, 0, v1);
             jit_insn_store_relative(main, v2m_addr, 0, v2);
             jit_insn_store_relative(main, jit_memory_ptr, 0, jit_insn_convert(main, jit_insn_add(main, mp, c2), jit_type_uint, 0));
-            // create a pair and place it on the stack
-            jit_value_t mp1s = jit_insn_shl(main, mp1, jit_value_create_nint_constant(main, jit_type_uint, 30));
-            // modify sp
-            jit_value_t pair = jit_insn_or(main, jit_insn_or(main, mp1s, mp),
-                                                 jit_value_create_long_constant(main, jit_type_ulong, 0x1000000000000000ull));
+            // create a pair referencing both cells and place it on the stack
+            jit_value_t pair = jit_insn_or(main, mp, jit_value_create_long_constant(main, jit_type_ulong, 0x1000000000000000ull));
             // store
             jit_insn_store_relative(main, jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp_2, c8)), 0, pair);
             // modify sp
@@ -858,33 +3399,33 @@ struct VM
             // modify sp
             jit_insn_store_relative(main, jit_stack_ptr, 0, jit_insn_add(main, sp, c1));
         }
+        // DEF writes into the env cell, incremental collection needs its store barrier
+        else if (op == "DEF" && gc_budget) jit_emit_interpret(instruction);
         else if (op == "DEF")
         {
             jit_value_t sp = jit_insn_load_relative(main, jit_stack_ptr, 0, jit_type_uint);
             jit_value_t sp_v1 = jit_insn_add(main, sp, cm1);
             jit_value_t sp_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp_v1, c8));
             jit_value_t ep = jit_insn_load_relative(main, jit_env_ptr, 0, jit_type_uint);
-            jit_value_t ep_addr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, ep, c8));
+            jit_value_t ep_addr = jit_heap_cell(ep);
             // migrate def pair from stack to memory
             jit_value_t mp = jit_insn_load_relative(main, jit_memory_ptr, 0, jit_type_uint);
-            jit_value_t defpair_mpaddr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, mp, c8));
+            jit_value_t defpair_mpaddr = jit_heap_cell(mp);
             jit_value_t defpair = jit_insn_load_relative(main, sp_addr, 0, jit_type_ulong);
             jit_insn_store_relative(main, defpair_mpaddr, 0, defpair);
             // migrate oldenv to the back of the main memory
-            jit_value_t oldenv_mpaddr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, jit_insn_add(main, mp, c1), c8));
+            jit_value_t oldenv_mpaddr = jit_heap_cell(jit_insn_add(main, mp, c1));
             jit_value_t env = jit_insn_load_relative(main, ep_addr, 0, jit_type_ulong);
             jit_insn_store_relative(main, oldenv_mpaddr, 0, env);
             // modify mp
             jit_insn_store_relative(main, jit_memory_ptr, 0, jit_insn_add(main, mp, c2));
-            // modify current env
-            jit_value_t right = jit_insn_shl(main, jit_insn_convert(main, jit_insn_add(main, mp, c1), jit_type_ulong, 0),
-                                                    jit_value_create_nint_constant(main, jit_type_uint, 30));
-            env = jit_insn_or(main, mp, right);
+            // modify current env, its first node is the pair of both cells
+            env = jit_insn_convert(main, mp, jit_type_ulong, 0);
             env = jit_insn_or(main, env, jit_value_create_long_constant(main, jit_type_ulong, 0x1000000000000000ull));
             jit_insn_store_relative(main, ep_addr, 0, env);
-            // load left cell (a string likely) and store it on the stack instead of the defpair 
-            jit_value_t left_idx = jit_insn_and(main, defpair, jit_value_create_nint_constant(main, jit_type_uint, 0x000000003FFFFFFFull));
-            jit_value_t left_addr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, left_idx, c8));
+            // load the car (a string likely) and store it on the stack instead of the defpair 
+            jit_value_t left_idx = jit_insn_and(main, defpair, jit_value_create_long_constant(main, jit_type_ulong, 0x00000000FFFFFFFFull));
+            jit_value_t left_addr = jit_heap_cell(left_idx);
             jit_insn_store_relative(main, sp_addr, 0, jit_insn_load_relative(main, left_addr, 0, jit_type_ulong));
         }
         else if (op == "EQSI")
@@ -914,17 +3455,11 @@ struct VM
             jit_value_t pair_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp1, c8));
             // load pair from stack
             jit_value_t pair = jit_insn_load_relative(main, pair_addr, 0, jit_type_ulong);
-            // read 'left' part of a cell
-            jit_value_t mask;
-            if (car) mask = jit_value_create_long_constant(main, jit_type_ulong, 0x000000003FFFFFFFull);
-            else mask = jit_value_create_long_constant(main, jit_type_ulong, 0x0FFFFFFFC0000000ull);
-            jit_value_t cell_addr = jit_insn_and(main, pair, mask);
-            if (!car) cell_addr = jit_insn_shr(main, cell_addr, jit_value_create_nint_constant(main, jit_type_uint, 30));
-            // load left cell from memory
-            jit_value_t result_addr = jit_insn_convert(main, 
-                                                        jit_insn_add(main, 
-                                                                        jit_memory_addr, 
-                                                                        jit_insn_mul(main, cell_addr, c8)), jit_type_uint, 0);
+            // the car is the cell the pair references, the cdr is the next one
+            jit_value_t cell_addr = jit_insn_and(main, pair, jit_value_create_long_constant(main, jit_type_ulong, 0x00000000FFFFFFFFull));
+            if (!car) cell_addr = jit_insn_add(main, cell_addr, c1);
+            // load the cell from memory
+            jit_value_t result_addr = jit_heap_cell(cell_addr);
             // store it on the stack
             if (remove_from_stack)
                 jit_insn_store_relative(main, jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp1, c8)), 0, 
@@ -940,7 +3475,7 @@ struct VM
             jit_value_t sp = jit_insn_load_relative(main, jit_stack_ptr, 0, jit_type_uint);
             jit_value_t sp_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp, c8));
             jit_value_t ep = jit_insn_load_relative(main, jit_env_ptr, 0, jit_type_uint);
-            jit_value_t ep_addr = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, ep, c8));
+            jit_value_t ep_addr = jit_heap_cell(ep);
             jit_value_t env = jit_insn_load_relative(main, ep_addr, 0, jit_type_ulong);
             jit_insn_store_relative(main, sp_addr, 0, env);   
             jit_insn_store_relative(main, jit_stack_ptr, 0, jit_insn_add(main, sp, c1));   
@@ -951,12 +3486,73 @@ struct VM
             jit_value_t sp1 = jit_insn_add(main, sp, cm1);
             jit_value_t sp_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp1, c8));
             jit_value_t mp = jit_insn_load_relative(main, jit_memory_ptr, 0, jit_type_uint);
-            jit_value_t envmp = jit_insn_add(main, jit_memory_addr, jit_insn_mul(main, mp, c8));
+            jit_value_t envmp = jit_heap_cell(mp);
             jit_insn_store_relative(main, jit_env_ptr, 0, mp);
             jit_insn_store_relative(main, envmp, 0, jit_insn_load_relative(main, sp_addr, 0, jit_type_ulong));
             jit_insn_store_relative(main, jit_stack_ptr, 0, sp1);
             jit_insn_store_relative(main, jit_memory_ptr, 0, jit_insn_add(main, mp, c1));
         }
+        else if (op == "VREF" || op == "VLEN")
+        {
+            jit_label_t slow_path = jit_label_undefined, done = jit_label_undefined;
+            jit_value_t sp = jit_insn_load_relative(main, jit_stack_ptr, 0, jit_type_uint);
+            jit_value_t v_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, jit_insn_add(main, sp, op == "VREF" ? cm2 : cm1), c8));
+            jit_value_t v = jit_insn_load_relative(main, v_addr, 0, jit_type_ulong);
+            jit_value_t vector_type = jit_value_create_long_constant(main, jit_type_ulong, Cell::make_object(Vector, 0).as64);
+            jit_insn_branch_if(main, jit_insn_ne(main, jit_insn_and(main, v, ctypemask), vector_type), &slow_path);
+            // the header's lower 32 bits hold the vector length
+            jit_value_t header_idx = jit_insn_and(main, v, jit_value_create_long_constant(main, jit_type_ulong, 0x00000000FFFFFFFFull));
+            jit_value_t header_addr = jit_heap_cell(header_idx);
+            jit_value_t size = jit_insn_convert(main, jit_insn_load_relative(main, header_addr, 0, jit_type_uint), jit_type_ulong, 0);
+            if (op == "VLEN")
+                jit_insn_store_relative(main, v_addr, 0, jit_insn_or(main, size, cinttype));
+            else
+            {
+                jit_value_t i_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, jit_insn_add(main, sp, cm1), c8));
+                jit_value_t i = jit_insn_load_relative(main, i_addr, 0, jit_type_ulong);
+                jit_insn_branch_if(main, jit_insn_ne(main, jit_insn_and(main, i, ctypemask), cinttype), &slow_path);
+                // negative indices are huge as unsigned 60 bit values and fail the bounds check too
+                jit_value_t idx = jit_insn_and(main, i, cdatamask);
+                jit_insn_branch_if(main, jit_insn_ge(main, idx, size), &slow_path);
+                jit_value_t element_addr = jit_insn_add(main, header_addr, jit_insn_mul(main, jit_insn_add(main, idx, c1), c8));
+                jit_insn_store_relative(main, v_addr, 0, jit_insn_load_relative(main, element_addr, 0, jit_type_ulong));
+                jit_insn_store_relative(main, jit_stack_ptr, 0, jit_insn_add(main, sp, cm1));
+            }
+            jit_insn_branch(main, &done);
+            jit_insn_label(main, &slow_path);
+            jit_emit_interpret(instruction);
+            jit_insn_label(main, &done);
+        }
+        // allocating and bulk vector operations run in the interpreter
+        else if (op == "MKVEC" || op == "VSET" || op == "VSUM" || op == "VADD") jit_emit_interpret(instruction);
+        // list builtins, map/filter/accum interpret the lambdas they call
+        else if (op == "LEN" || op == "NTH" || op == "APPEND" || op == "REVERSE" || 
+                 op == "MAP" || op == "FILTER" || op == "ACCUM" || op == "PMAP") jit_emit_interpret(instruction);
+        // string operations, PUSHSTR allocates long literals at run time
+        else if (op == "PUSHSTR" || op == "SLEN" || op == "SREF" || op == "SUBSTR" ||
+                 op == "CONCAT" || op == "SCMP" || op == "SFIND") jit_emit_interpret(instruction);
+        // hash tables
+        else if (op == "MKHASH" || op == "HGET" || op == "HSET" || op == "HDEL" || op == "HCOUNT") jit_emit_interpret(instruction);
+        else if (op == "PUSHLC") jit_emit_interpret(instruction);
+        else if (op == "CALLN")
+        {
+            // the function is looked up once, unknown ones panic in the interpreter when they are reached
+            const auto function = natives->functions.find(tokens[1]);
+            if (function == natives->functions.end()) jit_emit_interpret(instruction);
+            else
+            {
+                jit_type_t type[] = { jit_type_void_ptr, jit_type_void_ptr, jit_type_uint };
+                jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, type, 3, 1);
+                jit_constant_t vm_const, function_const;
+                vm_const.type = jit_type_void_ptr;
+                vm_const.un.ptr_value = this;
+                function_const.type = jit_type_void_ptr;
+                function_const.un.ptr_value = const_cast<lc::NativeFunction*>(&function->second);
+                jit_value_t args[] = { jit_value_create_constant(main, &vm_const), jit_value_create_constant(main, &function_const),
+                                       jit_value_create_nint_constant(main, jit_type_uint, std::stoi(tokens[2])) };
+                jit_insn_call_native(main, "calln", reinterpret_cast<void*>(&jit_vm_calln), signature, args, 3, JIT_CALL_NOTHROW);
+            }
+        }
         else if (op == "NOP")
         {
         }
@@ -967,9 +3563,24 @@ struct VM
             jit_value_t sp1 = jit_insn_add(main, sp, cm1);
             jit_value_t l_addr = jit_insn_add(main, jit_stack_addr, jit_insn_mul(main, sp1, c8));
             jit_value_t lambda = jit_insn_load_relative(main, l_addr, 0, jit_type_ulong);
-            jit_value_t lambda_addr = jit_insn_and(main, lambda, jit_value_create_long_constant(main, jit_type_ulong, 0x00000000FFFFFFFFull));
-            jit_value_t lambda_env = jit_insn_and(main, lambda, jit_value_create_long_constant(main, jit_type_ulong, 0x0FFFFFFF00000000ull));
-            lambda_env = jit_insn_shr(main, lambda_env, jit_value_create_nint_constant(main, jit_type_uint, 32));
+            // a Memo object is called by the VM, which looks up its cache
+            jit_label_t not_memo = jit_label_undefined, done = jit_label_undefined;
+            jit_value_t type_bits = jit_insn_shr(main, lambda, jit_value_create_nint_constant(main, jit_type_uint, 60));
+            jit_insn_branch_if_not(main, jit_insn_eq(main, type_bits, jit_value_create_long_constant(main, jit_type_ulong, Memo)), &not_memo);
+            {
+                jit_type_t type[] = { jit_type_void_ptr };
+                jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, type, 1, 1);
+                jit_constant_t val_const;
+                val_const.type = jit_type_void_ptr;
+                val_const.un.ptr_value = this;
+                jit_value_t val = jit_value_create_constant(main, &val_const);
+                jit_insn_call_native(main, "call_memo", reinterpret_cast<void*>(&jit_vm_call_memo), signature, &val, 1, JIT_CALL_NOTHROW);
+                jit_insn_branch(main, &done);
+            }
+            jit_insn_label(main, &not_memo);
+            jit_value_t lambda_env = jit_insn_and(main, lambda, jit_value_create_long_constant(main, jit_type_ulong, 0x00000000FFFFFFFFull));
+            jit_value_t lambda_addr = jit_insn_and(main, lambda, jit_value_create_long_constant(main, jit_type_ulong, 0x0FFFFFFF00000000ull));
+            lambda_addr = jit_insn_shr(main, lambda_addr, jit_value_create_nint_constant(main, jit_type_uint, 32));
             // push ip, setting cell type to InstructionPointer
             jit_value_t ip = jit_value_create_long_constant(main, jit_type_ulong, jit_jump_map[pc + 1]);
             ip = jit_insn_or(main, ip, jit_value_create_long_constant(main, jit_type_ulong, 0x5000000000000000ull));
@@ -997,6 +3608,7 @@ struct VM
             jit_insn_store_relative(main, jit_stack_ptr, 0, jit_insn_add(main, sp, c2));
             // branch to 'function'
             jit_insn_jump_table(main, lambda_addr, &jit_jump_table[0], jit_jump_table.size());
+            jit_insn_label(main, &done);
         }
         else if (op == "RET")
         {
@@ -1056,23 +3668,386 @@ struct VM
 };
 
 void jit_vm_gc(VM* vm) { vm->gc(); }
+void jit_vm_call_memo(VM* vm) { vm->call_memo(); }
+void jit_vm_calln(VM* vm, const lc::NativeFunction* function, uint32_t argc) { vm->call_native(*function, argc); }
+void jit_vm_print(VM* vm, uint64_t cell) { vm->print_cell(Cell(cell)); }
+void jit_vm_interpret(VM* vm, const char* instruction)
+{
+    const int pc = vm->pc;
+    vm->step_interpret<true>(instruction);
+    vm->pc = pc;
+}
+
+// the VM debug() reports on SIGINT, only set when running a single program
+VM* interrupted_vm = nullptr;
+
+std::vector<std::string> read_program(std::istream& in)
+{
+    std::string line;
+    std::vector<std::string> program;
+    while (std::getline(in, line))
+       program.push_back(line);
+    return program;
+}
+
+// lambda addresses of bytecode appended at 'base' of a code space, PUSHL -1 is the func? tag
+void relocate_program(std::vector<std::string>& program, size_t base)
+{
+    for (auto& line : program)
+    {
+        if (line.compare(0, 6, "PUSHL ") == 0 && line != "PUSHL -1")
+            line = "PUSHL " + std::to_string(std::stoul(line.substr(6)) + base);
+        else if (line.compare(0, 7, "PUSHLC ") == 0)
+        {
+            const size_t end = line.find(' ', 7);
+            line = "PUSHLC " + std::to_string(std::stoul(line.substr(7, end - 7)) + base) + line.substr(end);
+        }
+    }
+}
+
+// runs one request of the server, bytecode is appended to the code space and executed in a child of
+// the global env, which is kept at stack[0]. Code is never dropped, a lambda of the request may outlive it
+// (e.g. in a memo cache), and the prelude's objects are sealed, so a request can't change what later ones see
+void serve_request(VM& vm, std::vector<std::string>& code, std::vector<std::string> request, std::ostringstream& output)
+{
+    const size_t start = code.size();
+    relocate_program(request, start);
+    code.insert(code.end(), request.begin(), request.end());
+    vm.output = &output;
+    vm.stop = false;
+    vm.panicked = false;
+    vm.stack_ptr = 1;
+    vm.frame_ptr = 0;
+    vm.env_ptr = vm.stack[0].integer;
+    // the child env starts as a copy of the global env cell, so DEF in a request only rewrites the copy
+    const uint32_t env = vm.heap_alloc(1);
+    if (!env) return;
+    vm.heap[env] = vm.heap[vm.stack[0].integer];
+    vm.env_ptr = env;
+    vm.run(code, start);
+    // rejected code never ran, nothing refers to it
+    if (vm.rejected) code.resize(start);
+    if (!vm.panicked && vm.stack_ptr > 1)
+    {
+        if (output.tellp() > 0 && output.str().back() != '\n') output << endl;
+        output << "=> ";
+        vm.print_cell(vm.stack[vm.stack_ptr - 1]);
+        if (output.str().back() != '\n') output << endl;
+    }
+    vm.env_ptr = vm.stack[0].integer;
+    vm.stack_ptr = 1;
+}
+
+// keeps one VM with the prelude loaded and serves requests over a Unix domain socket: a client
+// sends bytecode or lisp source and closes its side of the connection;
+// the reply is the request's output, its result and its latency
+int run_server(const std::string& socket_path, const std::string& prelude_file)
+{
+    VM vm;
+    std::vector<std::string> code;
+    if (!prelude_file.empty() && !vm.load_image(prelude_file, code))
+    {
+        std::ifstream in(prelude_file);
+        if (!in) { cout << "Can't open " << prelude_file << endl; return 1; }
+        code = read_program(in);
+        vm.run(code);
+        if (vm.panicked) return 1;
+    }
+    // the global env is a GC root between requests
+    vm.stack[0] = Cell::make_env(vm.env_ptr);
+    vm.stack_ptr = 1;
+    vm.seal_objects();
+    const size_t prelude_size = code.size();
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) { cout << "Socket path too long" << endl; return 1; }
+    strcpy(address.sun_path, socket_path.c_str());
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(server, 16) < 0)
+    {
+        cout << "Can't listen on " << socket_path << endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Serving on " << socket_path << " (prelude: " << prelude_size << " instructions)" << endl;
+    size_t requests = 0, latency_total = 0;
+    while (true)
+    {
+        const int client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+        std::string request;
+        char buffer[4096];
+        while (true)
+        {
+            const ssize_t n = read(client, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            request.append(buffer, n);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const size_t first = request.find_first_not_of(" \t\r\n");
+        const bool source = first != std::string::npos && (request[first] == '(' || request[first] == ';');
+        std::ostringstream output;
+        std::vector<std::string> bytecode;
+        std::string error;
+        std::istringstream in(request);
+        if (!source) bytecode = read_program(in);
+        if (source && !lc::compile(request, bytecode, error)) output << error << endl;
+        else serve_request(vm, code, bytecode, output);
+        const size_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        output << "; " << latency << " us" << endl;
+        const std::string reply = output.str();
+        for (size_t sent = 0; sent < reply.size();)
+        {
+            const ssize_t n = write(client, reply.data() + sent, reply.size() - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(client);
+        requests += 1;
+        latency_total += latency;
+        cout << "Request " << requests << (source ? " (source)" : "") << ": " << latency << " us"
+             << (vm.panicked ? ", panicked" : "") << ", average " << latency_total / requests << " us" << endl;
+    }
+}
+
+// passes everything written to it to the output callback of an lc::Vm
+struct CallbackBuffer : std::streambuf
+{
+    std::function<void(const std::string&)> callback;
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        if (callback) callback(std::string(s, n));
+        return n;
+    }
+    int overflow(int c) override
+    {
+        const char x = c;
+        if (c != EOF) xsputn(&x, 1);
+        return c;
+    }
+};
+
+struct lc::Vm::State
+{
+    VM vm;
+    std::vector<std::string> code; // the code of all runs, later runs may call lambdas of earlier ones
+    CallbackBuffer buffer;
+    std::ostream output;
+
+    State(size_t heap_cells, size_t stack_cells) : vm(heap_cells, stack_cells), output(&buffer) { vm.output = &output; }
+};
+
+lc::Vm::Vm(size_t heap_cells, size_t stack_cells) : state(new State(heap_cells, stack_cells)) { }
+
+lc::Vm::~Vm() { }
+
+void lc::Vm::on_output(std::function<void(const std::string&)> callback) { state->buffer.callback = callback; }
+
+bool lc::Vm::run(const std::vector<std::string>& bytecode)
+{
+    VM& vm = state->vm;
+    const size_t start = state->code.size();
+    state->code.insert(state->code.end(), bytecode.begin(), bytecode.end());
+    std::vector<std::string> added(state->code.begin() + start, state->code.end());
+    relocate_program(added, start);
+    std::copy(added.begin(), added.end(), state->code.begin() + start);
+    vm.stop = false;
+    vm.panicked = false;
+    // the global env is a GC root at stack[0] during the run, a run that panics in a lambda leaves env_ptr
+    // at the lambda's env, so the next run's top-level DEFs would go there
+    vm.stack[0] = Cell::make_env(vm.env_ptr);
+    vm.stack_ptr = 1;
+    vm.frame_ptr = 0;
+    vm.run(state->code, start);
+    vm.env_ptr = vm.stack[0].integer;
+    vm.frame_ptr = 0;
+    // rejected code never ran, nothing refers to it
+    if (vm.rejected) state->code.resize(start);
+    return !vm.panicked;
+}
+
+bool lc::Vm::eval(const std::string& source)
+{
+    std::vector<std::string> bytecode;
+    std::string error;
+    if (compile(source, bytecode, error)) return run(bytecode);
+    state->output << error << endl;
+    return false;
+}
+
+std::vector<lc::Value> lc::Vm::results() const
+{
+    VM& vm = state->vm;
+    std::vector<Value> values;
+    // stack[0] holds the global env
+    for (size_t i = 1; i < vm.stack_ptr; ++i)
+    {
+        const Cell& c = vm.stack[i];
+        Value value = { value_type(c.type), 0, "" };
+        switch (c.type)
+        {
+            case Int: value.integer = c.int_value(); break;
+            case Lambda: value.integer = c.lambda_addr; break;
+            case Memo: value.integer = vm.heap[c.obj_ref + 1 + MemoLambda].lambda_addr; break;
+            case Vector: value.integer = vm.heap[c.obj_ref].obj_size; break;
+            case Hash: value.integer = vm.hash_field(c, HashCount).int_value(); break;
+            case BigInt: value.text = vm.number_to_string(c); break;
+            case String:
+            case Text:
+            {
+                TextView text;
+                vm.text_view(c, text);
+                value.text.assign(text.data, text.size);
+                break;
+            }
+            default: break;
+        }
+        values.push_back(value);
+    }
+    return values;
+}
+
+void lc::Vm::reset()
+{
+    state->vm.reset();
+    state->code.clear();
+}
 
-VM vm;
+void lc::Vm::define_native(const std::string& name, NativeFunction function) { state->vm.natives->define(name, function); }
 
+bool lc::Vm::load_natives(const std::string& path, std::string& error) { return state->vm.natives->load(path, error); }
+
+// runs bytecode files on a pool of worker threads, each with its own VM which is reset between programs;
+// every program's output is printed under its file name, in the order the files were given
+int run_batch(const std::vector<std::string>& files, size_t workers)
+{
+    struct Result { std::string output; size_t ticks; bool panicked; };
+    std::vector<Result> results(files.size());
+    std::atomic<size_t> next(0);
+    auto start = std::chrono::steady_clock::now();
+    auto worker = [&]()
+    {
+        VM vm;
+        // programs already run in parallel, pmap stays on the worker's thread
+        vm.pmap_threads = 1;
+        for (size_t i = next++; i < files.size(); i = next++)
+        {
+            std::ostringstream output;
+            vm.reset();
+            vm.output = &output;
+            std::ifstream in(files[i]);
+            if (!in) vm.panic("BATCH", "Can't open " + files[i]);
+            else
+            {
+                const std::vector<std::string> program = read_program(in);
+#if WITH_JIT
+                vm.init_jit();
+#endif
+                vm.run(program);
+            }
+            results[i].output = output.str();
+            results[i].ticks = vm.ticks;
+            results[i].panicked = vm.panicked;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; ++i) threads.emplace_back(worker);
+    for (auto& thread : threads) thread.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t ticks = 0, panicked = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        cout << "==> " << files[i] << " <==" << endl << results[i].output;
+        if (!results[i].output.empty() && results[i].output.back() != '\n') cout << endl;
+        ticks += results[i].ticks;
+        panicked += results[i].panicked;
+    }
+    cout << "Programs: " << files.size() << " (" << panicked << " panicked)" << endl;
+    cout << "Workers: " << workers << endl;
+    cout << "Wall time: " << size_t(seconds * 1000) << " ms" << endl;
+    cout << "Throughput: " << size_t(files.size() / seconds) << " programs/s, " << size_t(ticks / seconds) << " ticks/s" << endl;
+    return panicked ? 1 : 0;
+}
+
+#ifndef LC_LIBRARY
 int main(int argc, char** argv)
 {    
-    signal(SIGINT, [](int) { vm.debug(); exit(1); });
+    // vm --serve socket [prelude.bc]
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+        return run_server(argv[2], argc > 3 ? argv[3] : "");
+    // vm --batch [-t workers] file...
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        size_t workers = std::max(1u, std::thread::hardware_concurrency());
+        int first = 2;
+        if (argc > 3 && strcmp(argv[2], "-t") == 0)
+        {
+            workers = std::max(1, atoi(argv[3]));
+            first = 4;
+        }
+        const std::vector<std::string> files(argv + first, argv + argc);
+        if (files.empty()) { cout << "Usage: vm --batch [-t workers] file..." << endl; return 1; }
+        return run_batch(files, std::min(workers, files.size()));
+    }
 
-    std::string line;
+    // vm -s runs bytecode as it arrives
+    const bool streaming = argc > 1 && strcmp(argv[1], "-s") == 0;
+    // the heap is allocated with the VM, so its size is read first
+    size_t memory_size = MEMORY_SIZE;
+    for (int i = streaming ? 2 : 1; i + 1 < argc; i += 2)
+        if (strcmp(argv[i], "-m") == 0) memory_size = strtoull(argv[i + 1], nullptr, 10);
+    if (memory_size < 64 || memory_size >= MAX_MEMORY_SIZE)
+    {
+        cout << "Heap size must be between 64 and " << MAX_MEMORY_SIZE - 1 << " cells" << endl;
+        return 1;
+    }
+    VM vm(memory_size);
+    std::string image, dump_image;
+    // vm [-s] [-m heap_cells] [-p pmap_threads] [-g gc_threads] [-i gc_budget_us] [-l 1] [-v 0] [-n natives.so] [--image file] [--dump-image file]
+    for (int i = streaming ? 2 : 1; i + 1 < argc; i += 2)
+    {
+        std::string error;
+        if (strcmp(argv[i], "--image") == 0) image = argv[i + 1];
+        else if (strcmp(argv[i], "-n") == 0 && !vm.natives->load(argv[i + 1], error)) { cout << error << endl; return 1; }
+        else if (strcmp(argv[i], "--dump-image") == 0) dump_image = argv[i + 1];
+        else if (strcmp(argv[i], "-p") == 0) vm.pmap_threads = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-g") == 0) vm.gc_threads = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-i") == 0) vm.gc_budget = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-l") == 0) vm.gc_cdr_first = atoi(argv[i + 1]) != 0;
+        else if (strcmp(argv[i], "-v") == 0) vm.verify_bytecode = atoi(argv[i + 1]) != 0;
+    }
+    interrupted_vm = &vm;
+    signal(SIGINT, [](int) { interrupted_vm->debug(); exit(1); });
+
+    // the program read from stdin follows the image's code
     std::vector<std::string> program;
-    while (std::getline(std::cin, line))
-       program.push_back(line);
+    if (streaming && !image.empty()) { cout << "Images can't be used with -s" << endl; return 1; }
+    if (!image.empty() && !vm.load_image(image, program)) { cout << "Can't load image " << image << endl; return 1; }
+    const size_t start = program.size();
+    if (streaming) vm.run_stream(std::cin, program);
+    else
+    {
+        std::vector<std::string> input = read_program(std::cin);
+        relocate_program(input, start);
+        program.insert(program.end(), input.begin(), input.end());
 #if WITH_JIT
-    // if (argc > 1 && strcmp(argv[1],"-j") == 0) 
-        vm.init_jit();
+        // lambdas hold jump table indices in JIT mode, so images are made and used by the interpreter
+        // if (argc > 1 && strcmp(argv[1],"-j") == 0) 
+        if (image.empty() && dump_image.empty())
+            vm.init_jit();
 #endif
-    vm.run(program);
+        vm.run(program, start);
+    }
+    if (!dump_image.empty())
+    {
+        if (vm.panicked || !vm.dump_image(dump_image, program)) { cout << "Can't write image " << dump_image << endl; return 1; }
+        cout << "Image: " << vm.heap_ptr << " cells, " << program.size() << " instructions" << endl;
+    }
     vm.debug();
     return 0;    
 }
-
+#endif